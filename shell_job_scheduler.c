@@ -11,113 +11,1246 @@
  * Usage: ./shell
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
+#include <linux/ioprio.h>
+#include <sched.h>
+#include <linux/sched.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <dirent.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 
 #define MAX_LINE 1024
-#define MAX_JOBS 100
 #define MAX_ARGS 64
+#define MAX_EVENTS 64
+#define MAX_DEPS 64             // Jobs one submission can wait for
+
+// epoll data for a child's pidfd: tag bit plus the child's pid
+#define EV_PIDFD (1ULL << 63)
+// epoll data for a pipeline stage's pidfd and for relay pipes: tag bit
+// plus EV_JOB(job id, stage or link index)
+#define EV_STAGE (1ULL << 62)
+#define EV_RELAY (1ULL << 61)
+// epoll data for a job's output capture pipe: tag bit plus EV_JOB(job id, 0)
+#define EV_CAPTURE (1ULL << 60)
+// epoll data for the control socket: tag bit plus the client's slot, or
+// CONTROL_LISTENER for the listening socket
+#define EV_CONTROL (1ULL << 59)
+#define CONTROL_LISTENER 0xffffffffULL
+#define EV_JOB(job_id, idx) (((uint64_t)(uint32_t)(job_id) << 8) | (uint8_t)(idx))
+
+// Most bytes the relay moves per splice call
+#define RELAY_CHUNK (1 << 20)
+// Relay link index of a job's -o output pipe (pipeline links count from 0)
+#define RELAY_OUTPUT 0xff
+
+// Highest NUMA node id + 1 the placement engine handles
+#define NUMA_MAX_NODES 1024
+#define NUMA_MASK_LONGS (NUMA_MAX_NODES / (8 * sizeof(unsigned long)))
+
+// Timing wheel for job timeouts: WHEEL_LEVELS levels of WHEEL_SLOTS
+// slots, each level's slots WHEEL_SLOTS times as wide as the one below.
+// Reaches 2^32 ticks (about 497 days) ahead.
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK_NS 10000000LL    // 10ms
+
+// Job arrays: most elements one array may have, and where the ids of
+// their elements start (they are named <array id>.<index> instead)
+#define ARRAY_MAX_ELEMENTS (1 << 24)
+#define ARRAY_ELEMENT_IDS (1 << 30)
+
+// Control socket: longest request line, and most reply bytes a client
+// may leave unread before it is dropped
+#define CONTROL_LINE_MAX 4096
+#define CONTROL_OUT_MAX (64 << 20)
+
+// Longest command an array element gets once {} is filled in
+#define ARRAY_CMD_MAX (MAX_LINE * 16)
+
+// Buffer 'parallel' reads its items through; also the longest item
+#define PARALLEL_BUF_SIZE (1 << 20)
+
+// Completed jobs kept for 'history' and the 'stats' percentiles
+#define JOB_HISTORY 1024
+
+// Latency histograms: log-linear buckets, exact below 2^LAT_SUB_BITS ns
+// and 2^LAT_SUB_BITS buckets per power of two above (about 3% error)
+#define LAT_SUB_BITS 5
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB_COUNT)
+
+// Output capture: finished jobs whose output stays viewable, and the
+// chunk size for reading spilled output back
+#define CAPTURE_KEEP 64
+#define CAPTURE_IO_SIZE (64 * 1024)
+
+// Job store: jobs live in fixed-size chunks allocated on demand
+#define JOB_CHUNK_BITS 6
+#define JOB_CHUNK_SIZE (1 << JOB_CHUNK_BITS)
+#define JOB_CHUNK_MASK (JOB_CHUNK_SIZE - 1)
+
+// Hash indexes start at 2^JOB_INDEX_MIN_BITS buckets, grow past 50% load
+// and shrink below 12.5%
+#define JOB_INDEX_MIN_BITS 6
+#define NO_SLOT -1
+
+// Zygote spawn requests: size limit and most environment entries passed
+#define ZYGOTE_MSG_MAX (64 * 1024)
+#define ZYGOTE_MAX_ENV 4096
+
+// Command cache: PATH directories are re-stat'ed at most this often
+#define CMD_CACHE_RECHECK_NS 1000000000LL
+
+// String arena: initial size, and compaction once dead bytes exceed half
+// of a buffer at least this large
+#define ARENA_MIN_SIZE 4096
+#define ARENA_HDR_SIZE ((uint32_t)sizeof(str_hdr_t))
+
+// Spawn backends for external commands, selectable with 'set spawn'
+typedef enum {
+    SPAWN_FORK,             // fork + execvp
+    SPAWN_VFORK,            // clone(CLONE_VM | CLONE_VFORK): no page table copy
+    SPAWN_POSIX,            // posix_spawnp
+    SPAWN_ZYGOTE            // Ask the pre-forked zygote, whose image stays small
+} spawn_backend_t;
+
+// A cgroup the shell made under its delegated subtree: one job's own
+// (job-<id>), or one shared by every job submitted with the same --cgroup
+// name (group-<name>)
+typedef struct job_cgroup {
+    struct job_cgroup *next;    // Named groups in use
+    int fd;                     // The directory, for CLONE_INTO_CGROUP
+    int refs;                   // Jobs in it
+    int named;
+    char name[];
+} job_cgroup_t;
+
+// NUMA node jobs are placed on: its CPUs (those the shell may use) and
+// the running jobs placed there
+typedef struct {
+    int id;
+    int has_memory;         // CPU-only nodes get no memory policy
+    int jobs;
+    cpu_set_t cpus;
+} numa_node_t;
+
+// CPU and I/O scheduling of a job's processes; only the parts named in
+// set are applied, the rest is inherited from the shell
+typedef struct {
+    int set;                // JOB_SCHED_* bits
+    int policy;             // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE
+    int nice;
+    int ioprio;             // IOPRIO_PRIO_VALUE(class, level)
+} job_sched_t;
+
+#define JOB_SCHED_POLICY 1
+#define JOB_SCHED_NICE 2
+#define JOB_SCHED_IOPRIO 4
+
+// Limits a submission can set on its cgroup
+enum { CG_CPU_MAX, CG_MEM_MAX, CG_IO_WEIGHT, CG_LIMITS };
+
+// What a child needs before exec; every backend applies all of it
+typedef struct {
+    char **argv;
+    const char *path;       // Resolved executable, NULL = search PATH in the child
+    char **envp;            // Environment, NULL = environ
+    int new_pgrp;           // Put the child in its own process group...
+    pid_t pgid;             // ...or, if nonzero, join this one
+    int fds[3];             // Replacement stdin/stdout/stderr, -1 = inherit
+    const job_cgroup_t *cgroup; // Start the child in this cgroup, NULL = the shell's
+    const numa_node_t *node;    // Pin to its CPUs and prefer its memory, NULL = inherit
+    const job_sched_t *sched;   // Scheduling to start with, NULL = inherit
+    int exec_errno;         // Written by the vfork child if exec fails
+} spawn_req_t;
+
+// Zygote request header; followed by path, argv and env strings, each
+// NUL-terminated, and the fds to install as SCM_RIGHTS
+typedef struct {
+    uint32_t argc;
+    uint32_t envc;
+    int32_t new_pgrp;
+    int32_t pgid;
+    int32_t fd_map[3];      // Index into the passed fds per stdio fd, -1 = inherit
+    int32_t placed;         // node is set
+    numa_node_t node;
+    job_sched_t sched;      // Applied if sched.set
+} zygote_req_t;
+
+typedef struct {
+    pid_t pid;              // Child pid (a child of the shell), or -1
+    int32_t err;            // errno if the spawn or exec failed
+} zygote_reply_t;
+
+// Command cache entry: name -> absolute path found by walking PATH
+typedef struct {
+    char *name;             // NULL for an empty bucket
+    char *path;
+    int dir;                // Index of the PATH directory it was found in
+    unsigned hits;
+} cmd_entry_t;
 
 // Job states
 typedef enum {
+    QUEUED,                 // Waiting for a free run slot (see 'set maxjobs')
+    WAITING,                // Waiting for other jobs to finish (see 'after')
+    BACKOFF,                // Failed; queued again once its retry delay is up
     RUNNING,
     STOPPED,
     DONE
 } job_state_t;
 
-// Job structure
+// Job structure: only the fields lookups and listings touch, 40 bytes
+// per entry (eight 4-byte fields, then the 8-byte launch time). Anything
+// else goes in job_info_t.
 typedef struct {
-    int job_id;
-    pid_t pid;
+    int job_id;             // 0 while the slot is free
+    int slot;               // Own slot handle
+    pid_t pid;              // 0 until the job is launched
+    int pidfd;              // Owned; polled for exit, used for signals
     job_state_t state;
-    char command[MAX_LINE];
+    uint32_t command;       // Offset of the command text in the string arena
+    int prev, next;         // Insertion-order links (next = free list link when free)
+    int64_t started_ns;     // CLOCK_MONOTONIC launch time
 } job_t;
+_Static_assert(sizeof(job_t) == 40, "job_t is the hot record; keep it at 40 bytes");
+
+// Header preceding every string in the arena
+typedef struct {
+    uint32_t refs;          // 0 once the string is dead
+    uint32_t len;
+    uint32_t hash;
+    uint32_t fwd;           // New offset while compacting
+} str_hdr_t;
+
+// Interned string arena: identical commands share one copy, jobs refer
+// to it by offset so the buffer is free to move when it grows
+typedef struct {
+    char *data;
+    uint32_t used, cap;
+    uint32_t dead;          // Bytes held by strings with no references
+    uint32_t *buckets;      // Intern table: offset + 1, 0 = empty
+    unsigned bits;
+    uint32_t count;
+} str_arena_t;
+
+// Hardware counters kept per job when 'set perf on'
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_BRANCH_MISSES,
+       PERF_COUNTERS };
+
+// perf_event_open group on one process, leader first; all -1 when the
+// process is not being counted
+typedef struct {
+    int fd[PERF_COUNTERS];
+} perf_group_t;
+
+// One process of a pipeline
+typedef struct {
+    pid_t pid;
+    int pidfd;              // -1 once reaped
+    perf_group_t perf;
+} stage_t;
+
+// Relay link: the shell splices from one stage's stdout pipe into the
+// next stage's stdin pipe. Both ends are -1 once the link is closed.
+typedef struct {
+    int in;
+    int out;
+} relay_t;
+
+// Processes of a multi-stage job. The job's pid is stage 0's, which is
+// also the process group id when the pipeline runs in the background.
+typedef struct {
+    int nstages;
+    int live;               // Stages not reaped yet
+    relay_t *relays;        // nstages - 1 links, NULL unless relayed
+    stage_t stages[];
+} pipeline_t;
+
+// A job's -o output file
+typedef struct {
+    char *path;
+    int pipe_size;          // Spliced in through a pipe this large, 0 = direct
+    long long prealloc;     // Bytes to fallocate up front
+    relay_t relay;          // Pipe -> file while the job runs
+} job_output_t;
+
+// A job's --retry policy
+typedef struct {
+    int retries;            // Attempts allowed after the first
+    int64_t base_ns;        // Delay before retry n: base_ns * 2^(n-1), at most
+    int64_t max_ns;         // max_ns, of which a random half is waived
+    int any_failure;        // No --retry-on: any nonzero status is retried
+    uint32_t statuses[8];   // --retry-on bitmap of exit statuses (128 + signal)
+} job_retry_t;
+
+// Captured stdout/stderr of a background job. Offsets count every byte
+// the job ever wrote: [0, spilled) is in the spill file, [spilled, head)
+// was lost (the spill failed) and [head, tail) is in the ring.
+typedef struct {
+    int job_id;
+    int fd;                 // Read end of the job's output pipe, -1 at EOF
+    char *ring;             // cap bytes mapped twice back to back, so any
+    size_t cap;             // span of up to cap bytes is contiguous
+    uint64_t head, tail;
+    int spill_fd;           // Unlinked temp file, -1 until the ring first fills
+    uint64_t spilled;
+} capture_t;
+
+// Resource usage of a job's processes, summed over pipeline stages
+typedef struct {
+    int64_t user_us;
+    int64_t sys_us;
+    long maxrss_kb;         // Sum of each process's peak
+    long minflt, majflt;
+    long nvcsw, nivcsw;     // Voluntary / involuntary context switches
+    uint64_t perf[PERF_COUNTERS];   // All zero when not counted
+    long cg_peak_kb;        // Job's own cgroup: memory.peak,
+    int64_t cg_throttled_us;    // cpu.stat throttled_usec
+    long cg_oom_kills;      // and memory.events oom_kill
+} job_usage_t;
+
+// A completed job, as kept in the history
+typedef struct {
+    int job_id;             // 0 for a foreground command that never got one
+    uint32_t command;       // Arena offset; the history holds a reference
+    int status;
+    int64_t started_ns;
+    int64_t wall_ns;
+    job_usage_t usage;
+} job_record_t;
+
+// Fixed-size latency histogram in nanoseconds. Recording is a bucket
+// increment: no locks, no allocation.
+typedef struct {
+    uint64_t count;
+    int64_t min, max;
+    int64_t sum;
+    uint64_t buckets[LAT_BUCKETS];
+} latency_hist_t;
 
-// Job queue
-job_t jobs[MAX_JOBS];
+// Timer in the wheel, kept inside the job it times. Unlinking needs no
+// search: pprev points at whatever points at it.
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **pprev;     // NULL while not armed
+    uint64_t expires;               // Tick it fires on
+    int level;
+    int job_id;
+} wheel_timer_t;
+
+// Dependency graph edge, kept on the job being waited for
+typedef struct {
+    int job_id;             // The dependent job
+    int need_ok;            // afterok: cancel the dependent unless this job exits 0
+} dep_edge_t;
+
+// Per-job data the lookup and listing paths never touch; kept beside
+// job_t in its chunk rather than inside it
+typedef struct {
+    char *argv;             // Packed NUL-separated argv, for launching later
+    int argc;
+    int priority;           // Dispatch order while queued, lower first (like nice)
+    int heap_pos;           // Position in run_queue, -1 when not queued
+    int deps_left;          // Unfinished jobs this one is waiting for
+    dep_edge_t *dependents; // Jobs waiting for this one
+    int ndependents, dep_cap;
+    int status;             // Exit code, 128 + signal if killed, -1 until known
+                            // (a pipeline: its last stage)
+    job_usage_t usage;      // Of the processes reaped so far
+    perf_group_t perf;      // A single process's counters; stages have their own
+    pipeline_t *pipeline;   // NULL for a single process
+    job_output_t *output;   // NULL = output goes to the terminal
+    capture_t *capture;     // Output captured by the shell ('set capture')
+    job_cgroup_t *cgroup;   // NULL = runs in the shell's cgroup
+    int node_req;           // numa_nodes index from --node, -1 = any
+    int node;               // numa_nodes index it runs on, -1 = not placed
+    job_sched_t sched;      // What it was started with or last changed to
+    int auto_sched;         // sched is 'set bgsched': dropped while in the foreground
+    int64_t timeout_ns;     // --timeout, counted from launch, 0 = none
+    int64_t deadline_ns;    // --deadline as CLOCK_MONOTONIC, 0 = none
+    int timed_out;          // SIGTERM sent; the timer now runs the grace period
+    wheel_timer_t timer;    // Armed for whichever of the above comes first,
+                            // or while in BACKOFF for the end of the delay
+    job_retry_t *retry;     // NULL = no retries
+    int attempt;            // 1 for the first run
+    struct job_array *array;    // An array's elements yet to run; NULL otherwise
+    int array_id;           // Array this job is an element of, 0 = none
+    int array_index;
+} job_info_t;
+
+// Pending queue entry. Keys are copied in so sifting never has to chase
+// job pointers.
+typedef struct {
+    int priority;
+    int seq;                // Job id: FIFO among equal priorities
+    int slot;
+} queue_entry_t;
+
+// Scheduler options given before the command, e.g. "-p -5 make &" or
+// "after 3,4 make install &"
+typedef struct {
+    int priority;
+    dep_edge_t deps[MAX_DEPS];  // job_id here is the job to wait for
+    int ndeps;
+    const char *output;     // -o <file>
+    int pipe_size;          // --pipe-size <bytes>
+    long long prealloc;     // --prealloc <bytes>
+    const char *cgroup;     // --cgroup <name>
+    char limits[CG_LIMITS][32]; // cgroup file contents, "" = not set
+    int node;               // --node <id>, -1 = not given
+    job_sched_t sched;      // --sched, --nice, --ioprio
+    int64_t timeout_ns;     // --timeout <duration>
+    int64_t deadline_ns;    // --deadline <HH:MM>, as CLOCK_MONOTONIC
+    job_retry_t retry;      // --retry, --backoff, --retry-on
+} job_opts_t;
+
+// Where 'parallel' gets its items: one per line, read in large blocks.
+// Items are used in place, so a line is never copied until it is needed.
+typedef struct {
+    int fd;
+    int eof;
+    int error;              // errno of a failed read, 0 = none
+    size_t start, end;      // Unconsumed input is buf[start, end)
+    char buf[];             // PARALLEL_BUF_SIZE bytes, plus one for a NUL
+} item_reader_t;
+
+// Job array: its own argv is the template, run once per index in
+// [first, last] with {} replaced by the index. Elements become jobs only
+// when they start; the array itself sits in the run queue meanwhile.
+// A 'parallel' array runs it once per batch of items read from input
+// instead, and has one element pending until the input runs out.
+typedef struct job_array {
+    int first, last;
+    int next;               // Lowest index not taken yet
+    uint64_t *taken;        // Indexes taken out of order ('fg'/'kill' <id>.<index>)
+    int limit;              // Most elements running at once, 0 = no limit
+    int pending;            // Neither started nor cancelled
+    int running;            // Elements in the job table
+    int done, failed, cancelled;
+    job_opts_t opts;        // Given to each element; strings are stored after
+    int auto_sched;         // the struct
+    item_reader_t *input;   // NULL for an index range
+    int batch;              // Items per element
+    int append;             // No {} in the template: items go at the end
+    long long items;        // Items read so far
+} job_array_t;
+
+// A control socket connection. Requests are read into in[] and answered
+// in order; replies wait in out while the client is not reading.
+typedef struct {
+    int fd;
+    int wait_id;            // Job a 'wait' is pending on, 0 = none
+    int closing;            // Peer is done sending: drop once answered
+    uint32_t events;        // What it is polled for
+    size_t in_len;
+    char *out;
+    size_t out_len, out_cap;
+    char in[CONTROL_LINE_MAX];
+} control_client_t;
+
+// A slab of job slots. Slot handles are (chunk << JOB_CHUNK_BITS) | offset;
+// chunks are never moved, so job_t pointers stay valid until removal
+typedef struct {
+    job_t jobs[JOB_CHUNK_SIZE];
+    job_info_t info[JOB_CHUNK_SIZE];
+    int free_head;          // Free slots within this chunk
+    int live;
+    int prev_avail, next_avail;  // Links in the list of chunks with free slots
+} job_chunk_t;
+
+// Open-addressing index (linear probing) mapping a key to a slot
+typedef struct {
+    int *buckets;
+    unsigned bits;
+} job_index_t;
+
+// Job table
+job_chunk_t **job_chunks = NULL;
+int chunk_cap = 0;
+int avail_chunks = NO_SLOT;     // Chunks with at least one free slot
+int empty_chunks = 0;           // Fully free chunks kept around (at most one)
 int job_count = 0;
 int next_job_id = 1;
+int next_element_id = ARRAY_ELEMENT_IDS;
+
+// Admission control: at most max_running jobs have a process (0 = no
+// limit); the rest wait in run_queue, an indexed binary min-heap
+int max_running = 0;
+int active_jobs = 0;            // Jobs with a live process
+queue_entry_t *run_queue = NULL;
+int queue_len = 0;
+int queue_cap = 0;
+
+// Live slots in insertion order (for 'jobs' listing)
+int job_head = NO_SLOT;
+int job_tail = NO_SLOT;
+
+job_index_t pid_index;
+job_index_t id_index;
+
+str_arena_t arena;
+
+// Command cache, valid for the PATH value in cmd_path_env
+cmd_entry_t *cmd_cache = NULL;
+unsigned cmd_cache_bits = 0;
+unsigned cmd_cache_count = 0;
+char *cmd_path_env = NULL;
+char **path_dirs = NULL;        // PATH split into directories
+struct timespec *path_mtimes = NULL;
+int path_ndirs = 0;
+int64_t path_checked_ns = 0;
+
+// Event loop: SIGCHLD/SIGINT/SIGTSTP stay blocked and arrive through
+// signal_fd, so every job table mutation happens on the main thread
+int epoll_fd = -1;
+int signal_fd = -1;
+int timer_fd = -1;              // Armed for the wheel's next due tick
+sigset_t child_sigmask;         // Signal mask restored in children
+struct rlimit child_nofile;     // fd limit restored in children
+struct rlimit shell_nofile;     // Raised fd limit the shell runs with
+
+const char *spawn_names[] = { "fork", "vfork", "posix_spawn", "zygote" };
+spawn_backend_t spawn_backend = SPAWN_POSIX;
+
+// Zygote helper: forked first thing in init_shell, spawns on request
+pid_t zygote_pid = -1;
+int zygote_sock = -1;
+
+// Pipelines: buffer size of each link (0 = kernel default), and whether
+// the shell relays between stages instead of connecting them directly
+int pipe_size = 0;
+int pipe_relay = 0;
+
+// Completed jobs, a ring of JOB_HISTORY records, plus all-time totals
+job_record_t *history = NULL;
+int history_len = 0;
+int history_next = 0;
+long total_jobs = 0;
+long total_failed = 0;
+job_usage_t total_usage;
+int64_t total_wall_ns = 0;
+
+// Spawn call to exec, exec to exit, and exit to reap, for every process
+latency_hist_t launch_latency;
+latency_hist_t run_latency;
+latency_hist_t reap_latency;
+int64_t wake_ns = 0;            // When epoll_wait last returned
+
+// Hardware counters: attached to new jobs while on; user space only when
+// perf_event_paranoid rules out kernel counting
+int perf_enabled = 0;
+int perf_user_only = 0;
+perf_group_t fg_perf = { { -1, -1, -1, -1 } };  // Foreground command outside the table
+
+// Output capture: ring size for new background jobs (0 = off), and the
+// captures of finished jobs, oldest overwritten first
+size_t capture_size = 0;
+capture_t *done_captures[CAPTURE_KEEP];
+int done_capture_next = 0;
+int following = 0;              // 'output --follow' is running
 
-// Signal handling flags
-volatile sig_atomic_t fg_pid = 0;
+// cgroup v2 directory job cgroups go under: 'set cgroup <dir>', else the
+// shell's own cgroup, looked up on first use
+char cgroup_root[PATH_MAX] = "";
+int cgroup_root_fd = -1;
+job_cgroup_t *cgroup_groups = NULL;
+
+// Job timeouts: one timing wheel for every job's timer. wheel_now is the
+// last tick processed; tick 0 is wheel_base_ns. Jobs still running
+// kill_grace_ns after their SIGTERM get SIGKILL.
+wheel_timer_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+int wheel_count[WHEEL_LEVELS];
+uint64_t wheel_now = 0;
+uint64_t wheel_alarm_tick = UINT64_MAX;    // What timer_fd is armed for
+int64_t wheel_base_ns = 0;
+int64_t kill_grace_ns = 5000000000LL;
+
+// Control socket ('set control'): listening socket, its path, and the
+// connected clients by slot (NULL = free)
+int control_fd = -1;
+char control_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = "";
+control_client_t **control_clients = NULL;
+int control_cap = 0;
+int control_count = 0;
+int control_waiters = 0;        // Clients with a 'wait' pending
+int control_replies = 0;        // Replies queued outside control_event()
+
+// Scheduling class of background jobs submitted without --sched/--ioprio
+// ('set bgsched'); SCHED_OTHER leaves them alone
+int bg_policy = SCHED_OTHER;
+
+// NUMA placement: on for every job with 'set numa on', else only for
+// --node. Topology is read on first use. The shell's own affinity and
+// memory policy are kept to restore after posix_spawn.
+int numa_enabled = 0;
+numa_node_t *numa_nodes = NULL;
+int numa_count = 0;
+cpu_set_t shell_cpus;
+int shell_mempolicy = MPOL_DEFAULT;
+unsigned long shell_nodemask[NUMA_MASK_LONGS];
+
+// Foreground job (0 while the shell is reading commands)
+pid_t fg_pid = 0;
+int fg_pidfd = -1;
+uint32_t fg_command = UINT32_MAX;   // Foreground command outside the job table,
+int64_t fg_started_ns = 0;          // for its history record
+int fg_array = 0;               // Array a foreground 'parallel' is waiting for
+int at_prompt = 0;              // Prompt is showing; notifications reprint it
+int notify_pending = 0;         // Job notices printed since the last prompt
+
+// Pending input; commands are split out of it line by line
+char input_buf[MAX_LINE];
+int input_len = 0;
+int input_eof = 0;
+int input_skip = 0;             // Dropping the rest of an overlong line
+int stdin_polled = 1;           // 0 for files, which epoll refuses; read directly
 
 // Function prototypes
 void init_shell();
+void init_job_table();
+void print_prompt();
+void dispatch_events(int timeout);
+void read_input();
+void watch_stdin(int on);
+void run_line(char *line);
 void parse_command(char *line, char **args, int *background);
 int execute_command(char **args, int background);
-void add_job(pid_t pid, const char *command, job_state_t state);
+int parse_job_opts(char **args, job_opts_t *opts);
+pid_t spawn_child(spawn_req_t *req);
+void child_setup(spawn_req_t *req);
+void start_zygote();
+void spawn_bench(int count, int ballast_mb);
+job_t* add_job(int job_id, pid_t pid, int pidfd, const char *command, job_state_t state);
 void remove_job(pid_t pid);
+void delete_job(job_t *job);
+job_t* array_submit(char **argv, const char *cmd, const job_opts_t *opts,
+                    int auto_sched, int first, int last, int limit,
+                    item_reader_t *input, int batch);
+void array_update(int array_id);
+void set_job_pid(job_t *job, pid_t pid, int pidfd);
+job_info_t* job_info(const job_t *job);
+int start_child(spawn_req_t *req, uint64_t tag, pid_t *pid, int *pidfd);
+job_cgroup_t* cgroup_get(int job_id, const job_opts_t *opts);
+void cgroup_put(job_cgroup_t *cg, job_usage_t *usage);
+int numa_load();
+int numa_index(int node_id);
+void sched_class(int policy, job_sched_t *s);
+int sched_job(job_t *job, const job_sched_t *s);
+int launch_job(job_t *job);
+int launch_pipeline(job_t *job, char **argv, int new_pgrp);
+void relay_pipe(int job_id, int link);
+void wheel_add(wheel_timer_t *t, uint64_t expires);
+void wheel_del(wheel_timer_t *t);
+void wheel_expire();
+void job_timer_start(job_t *job);
+void capture_ready(int job_id);
+void signal_job(job_t *job, int sig);
+int enqueue_job(job_t *job);
+void dequeue_job(job_t *job);
+void requeue_job(job_t *job, int priority);
+int add_dependency(job_t *parent, job_t *job, int need_ok);
+void dispatch_queued();
 void update_job_state(pid_t pid, job_state_t state);
 job_t* find_job_by_pid(pid_t pid);
 job_t* find_job_by_id(int job_id);
-void list_jobs();
-void wait_for_fg(pid_t pid);
+const char* job_command(const job_t *job);
+uint32_t str_intern(const char *str);
+void str_release(uint32_t off);
+const char* resolve_command(const char *name);
+void cmd_cache_flush(int min_dir);
+void list_cmd_cache();
+void list_jobs(int long_format);
+void history_add(int job_id, uint32_t command, int status, int64_t started_ns,
+                 const job_usage_t *usage);
+void list_history(int count);
+void print_stats();
+void print_latency();
+void wait_for_fg(pid_t pid, int pidfd);
+void wait_for_array(int array_id);
+void follow_output(int job_id, uint64_t from);
+int control_open(const char *path);
+void control_close();
+void control_accept();
+void control_event(int slot, uint32_t events);
+void control_job_done(job_t *job);
+void control_flush_all();
 int builtin_command(char **args);
-void sigchld_handler(int sig);
-void sigint_handler(int sig);
-void sigtstp_handler(int sig);
+void handle_signals();
+int watch_child(uint64_t tag, int pidfd);
+void discard_child(int pidfd);
+void reap_job(pid_t pid);
+void reap_stage(int job_id, int stage);
+void reap_stopped();
 
 int main() {
-    char line[MAX_LINE];
-    char *args[MAX_ARGS];
-    int background;
-    
     init_shell();
     
     printf("=== Unix Shell Job Scheduler ===\n");
     printf("Type 'help' for available commands\n\n");
+    print_prompt();
     
-    while (1) {
-        printf("shell> ");
-        fflush(stdout);
-        
-        // Read command
-        if (fgets(line, MAX_LINE, stdin) == NULL) {
-            if (feof(stdin)) {
-                printf("\n");
+    while (!input_eof) {
+        if (stdin_polled) {
+            dispatch_events(-1);
+        } else {
+            // A file is always readable, so only pick up what else is ready
+            dispatch_events(0);
+            read_input();
+        }
+    }
+    
+    control_close();
+    printf("\n");
+    return 0;
+}
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int latency_bucket(int64_t ns) {
+    uint64_t v = ns;
+    if (v < 2 * LAT_SUB_COUNT) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+    return shift * LAT_SUB_COUNT + (int)(v >> shift);
+}
+
+// Midpoint of the values that land in a bucket
+static int64_t latency_bucket_value(int bucket) {
+    if (bucket < 2 * LAT_SUB_COUNT) return bucket;
+    int shift = bucket / LAT_SUB_COUNT - 1;
+    int64_t sub = bucket - shift * LAT_SUB_COUNT;
+    return (sub << shift) + ((1LL << shift) >> 1);
+}
+
+static void latency_record(latency_hist_t *h, int64_t ns) {
+    if (ns < 0) ns = 0;
+    h->buckets[latency_bucket(ns)]++;
+    if (h->count == 0 || ns < h->min) h->min = ns;
+    if (ns > h->max) h->max = ns;
+    h->sum += ns;
+    h->count++;
+}
+
+static void perf_close(perf_group_t *g) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (g->fd[i] >= 0) close(g->fd[i]);
+        g->fd[i] = -1;
+    }
+}
+
+// Open the counter group on pid (0 = the shell). inherit extends it to
+// every process pid starts from then on. Returns -1 with errno set.
+static int perf_open(pid_t pid, perf_group_t *g) {
+    static const uint64_t events[PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        g->fd[i] = -1;
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i];
+        attr.inherit = 1;
+        attr.exclude_kernel = perf_user_only;
+        attr.exclude_hv = perf_user_only;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        g->fd[i] = syscall(SYS_perf_event_open, &attr, pid, -1,
+                           i > 0 ? g->fd[0] : -1, PERF_FLAG_FD_CLOEXEC);
+        if (g->fd[i] < 0) {
+            int err = errno;
+            perf_close(g);
+            errno = err;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Count a freshly spawned child. It is already running, so the first
+// instructions after exec go uncounted; one that has already exited
+// (ESRCH) is simply not counted. Any other failure turns counting off.
+static void perf_attach(pid_t pid, perf_group_t *g) {
+    if (!perf_enabled) return;
+    if (perf_open(pid, g) < 0 && errno != ESRCH) {
+        printf("perf: %s; counters turned off\n", strerror(errno));
+        perf_enabled = 0;
+    }
+}
+
+// Add a group's counts so far (its process and inherited children, exited
+// or not) to u, scaled up if the kernel had to multiplex the counters
+static void perf_read(const perf_group_t *g, job_usage_t *u) {
+    struct {
+        uint64_t nr, enabled, running;
+        uint64_t values[PERF_COUNTERS];
+    } buf;
+    
+    if (g->fd[0] < 0) return;
+    if (read(g->fd[0], &buf, sizeof(buf)) != sizeof(buf) || buf.nr != PERF_COUNTERS) {
+        return;
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        uint64_t v = buf.values[i];
+        if (buf.running > 0 && buf.running < buf.enabled) {
+            v = (uint64_t)((double)v * buf.enabled / buf.running);
+        }
+        u->perf[i] += v;
+    }
+}
+
+// Read what is left and release the counters of a reaped process
+static void perf_collect(perf_group_t *g, job_usage_t *u) {
+    perf_read(g, u);
+    perf_close(g);
+}
+
+// Duration for messages and listings: 250ms, 1.5s, 30s, 5m, 2.5h
+static void format_duration(int64_t ns, char *buf, size_t n) {
+    if (ns < 1000000000) {
+        snprintf(buf, n, "%lldms", (long long)(ns / 1000000));
+    } else if (ns < 120000000000LL) {
+        snprintf(buf, n, "%.3gs", ns / 1e9);
+    } else if (ns < 7200000000000LL) {
+        snprintf(buf, n, "%.3gm", ns / 60e9);
+    } else {
+        snprintf(buf, n, "%.3gh", ns / 3600e9);
+    }
+}
+
+// Tick a CLOCK_MONOTONIC time falls in, and the first tick not before it
+static uint64_t wheel_tick(int64_t ns) {
+    return ns <= wheel_base_ns ? 0 : (uint64_t)(ns - wheel_base_ns) / WHEEL_TICK_NS;
+}
+
+static uint64_t wheel_tick_ceil(int64_t ns) {
+    return ns <= wheel_base_ns ? 0 :
+           (uint64_t)(ns - wheel_base_ns + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+}
+
+static int wheel_size() {
+    int n = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        n += wheel_count[level];
+    }
+    return n;
+}
+
+// Arm timer_fd for a tick; UINT64_MAX disarms it
+static void wheel_alarm(uint64_t tick) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (tick != UINT64_MAX) {
+        int64_t ns = wheel_base_ns + (int64_t)tick * WHEEL_TICK_NS;
+        its.it_value.tv_sec = ns / 1000000000;
+        its.it_value.tv_nsec = ns % 1000000000;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    wheel_alarm_tick = tick;
+}
+
+// Link t into the lowest level whose span, counted from wheel_now, still
+// reaches its tick. t->expires must not be before wheel_now.
+static void wheel_insert(wheel_timer_t *t) {
+    uint64_t delta = t->expires - wheel_now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    wheel_timer_t **slot = &wheel[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next = *slot;
+    if (*slot != NULL) (*slot)->pprev = &t->next;
+    *slot = t;
+    t->pprev = slot;
+    t->level = level;
+    wheel_count[level]++;
+}
+
+// Tick the wheel next has to look at: the first non-empty slot of each
+// level, where a slot above level 0 is looked at when its span starts
+static uint64_t wheel_next_due() {
+    uint64_t due = UINT64_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (wheel_count[level] == 0) continue;
+        int shift = WHEEL_BITS * level;
+        uint64_t span = wheel_now >> shift;
+        for (int k = 1; k <= WHEEL_SLOTS; k++) {
+            if (wheel[level][(span + k) & WHEEL_MASK] != NULL) {
+                if (((span + k) << shift) < due) due = (span + k) << shift;
                 break;
             }
-            continue;
         }
-        
-        // Remove newline
-        line[strcspn(line, "\n")] = 0;
-        
-        // Skip empty lines
-        if (strlen(line) == 0) continue;
-        
-        // Parse command
-        parse_command(line, args, &background);
-        
-        // Check for builtin commands
-        if (builtin_command(args)) {
-            continue;
+    }
+    return due;
+}
+
+// Arm t for tick expires, or the next tick if that has passed. Re-arming
+// an armed timer moves it.
+void wheel_add(wheel_timer_t *t, uint64_t expires) {
+    wheel_del(t);
+    if (wheel_size() == 0) {
+        // Nothing can be due in between: skip the idle ticks
+        uint64_t now_tick = wheel_tick(now_ns());
+        if (now_tick > wheel_now) wheel_now = now_tick;
+    }
+    if (expires <= wheel_now) expires = wheel_now + 1;
+    if (expires - wheel_now >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS))) {
+        expires = wheel_now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    t->expires = expires;
+    wheel_insert(t);
+    
+    // Adding can only bring the next wakeup forward
+    int shift = WHEEL_BITS * t->level;
+    uint64_t due = (expires >> shift) << shift;
+    if (due < wheel_alarm_tick) wheel_alarm(due);
+}
+
+// Disarm t; no-op if it is not armed. The alarm is left alone: waking
+// up for nothing costs less than finding the next due slot.
+void wheel_del(wheel_timer_t *t) {
+    if (t->pprev == NULL) return;
+    *t->pprev = t->next;
+    if (t->next != NULL) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    wheel_count[t->level]--;
+}
+
+// How messages name a job: its id, or <array id>.<index> for an array
+// element. Valid until the next call.
+static const char* job_name(const job_t *job) {
+    static char name[32];
+    const job_info_t *info = job_info(job);
+    if (info->array_id) {
+        snprintf(name, sizeof(name), "%d.%d", info->array_id, info->array_index);
+    } else {
+        snprintf(name, sizeof(name), "%d", job->job_id);
+    }
+    return name;
+}
+
+// A job's timer went off. A job in BACKOFF is queued again; one that is
+// not running at its deadline is cancelled; a running one gets SIGTERM,
+// and SIGKILL if it outlives the grace period.
+static void job_timer_fire(wheel_timer_t *t) {
+    job_t *job = find_job_by_id(t->job_id);
+    job_info_t *info = job_info(job);
+    char limit[32];
+    
+    if (job->state == BACKOFF && (info->deadline_ns == 0 || now_ns() < info->deadline_ns)) {
+        job->state = QUEUED;
+        if (enqueue_job(job) < 0) {
+            printf("\n[%s] Job table: out of memory: %s\n", job_name(job), job_command(job));
+            notify_pending = 1;
+            delete_job(job);
+            return;
+        }
+        dispatch_queued();
+        return;
+    }
+    notify_pending = 1;
+    if (info->timed_out) {
+        format_duration(kill_grace_ns, limit, sizeof(limit));
+        printf("\n[%s] Still running %s after SIGTERM, sending SIGKILL: %s\n",
+               job_name(job), limit, job_command(job));
+        signal_job(job, SIGKILL);
+        return;
+    }
+    if (job->pid == 0) {
+        printf("\n[%s] Cancelled, deadline passed: %s\n", job_name(job), job_command(job));
+        delete_job(job);
+        return;
+    }
+    
+    if (info->deadline_ns > 0 && (info->timeout_ns == 0 ||
+                                  info->deadline_ns < job->started_ns + info->timeout_ns)) {
+        printf("\n[%s] Deadline passed, sending SIGTERM: %s\n", job_name(job), job_command(job));
+    } else {
+        format_duration(info->timeout_ns, limit, sizeof(limit));
+        printf("\n[%s] Timed out after %s, sending SIGTERM: %s\n",
+               job_name(job), limit, job_command(job));
+    }
+    info->timed_out = 1;
+    signal_job(job, SIGTERM);
+    // A stopped job would not act on it until continued
+    if (job->state == STOPPED) {
+        signal_job(job, SIGCONT);
+        job->state = RUNNING;
+    }
+    wheel_add(&info->timer, wheel_tick_ceil(now_ns() + kill_grace_ns));
+}
+
+// timer_fd went off: step the wheel up to the current tick, handing each
+// level's slot down as its span starts and firing level 0's due slot,
+// then arm for whatever is next
+void wheel_expire() {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("timerfd");
+    }
+    
+    uint64_t target = wheel_tick(now_ns());
+    if (wheel_size() == 0 && target > wheel_now) wheel_now = target;
+    while (wheel_now < target) {
+        wheel_now++;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            int shift = WHEEL_BITS * level;
+            if (wheel_now & ((1ULL << shift) - 1)) break;
+            wheel_timer_t **slot = &wheel[level][(wheel_now >> shift) & WHEEL_MASK];
+            while (*slot != NULL) {
+                wheel_timer_t *t = *slot;
+                wheel_del(t);
+                wheel_insert(t);
+            }
         }
         
-        // Execute command
-        execute_command(args, background);
+        // Detach the due slot first: firing can arm and disarm timers,
+        // including others in it
+        wheel_timer_t *due = wheel[0][wheel_now & WHEEL_MASK];
+        wheel[0][wheel_now & WHEEL_MASK] = NULL;
+        if (due != NULL) due->pprev = &due;
+        while (due != NULL) {
+            wheel_timer_t *t = due;
+            wheel_del(t);
+            job_timer_fire(t);
+        }
     }
+    wheel_alarm(wheel_next_due());
+}
+
+// Arm a job's timer for its deadline, or for its timeout once it has
+// been launched, whichever comes first; with neither, disarm it
+void job_timer_start(job_t *job) {
+    job_info_t *info = job_info(job);
+    int64_t due = info->deadline_ns;
     
-    return 0;
+    if (info->timeout_ns > 0 && job->pid > 0 &&
+        (due == 0 || job->started_ns + info->timeout_ns < due)) {
+        due = job->started_ns + info->timeout_ns;
+    }
+    if (due == 0) {
+        wheel_del(&info->timer);
+        return;
+    }
+    info->timer.job_id = job->job_id;
+    wheel_add(&info->timer, wheel_tick_ceil(due));
 }
 
 void init_shell() {
-    // Set up signal handlers
-    signal(SIGCHLD, sigchld_handler);  // Handle child process termination
-    signal(SIGINT, sigint_handler);     // Handle Ctrl+C
-    signal(SIGTSTP, sigtstp_handler);   // Handle Ctrl+Z
+    // One pidfd per job: lift the soft fd limit as far as allowed, but
+    // hand children the original limit
+    getrlimit(RLIMIT_NOFILE, &child_nofile);
+    shell_nofile = child_nofile;
+    shell_nofile.rlim_cur = shell_nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &shell_nofile);
+    
+    // Block the signals we handle and read them from a signalfd instead
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);  // Child process state change
+    sigaddset(&mask, SIGINT);   // Ctrl+C
+    sigaddset(&mask, SIGTSTP);  // Ctrl+Z
+    if (sigprocmask(SIG_BLOCK, &mask, &child_sigmask) < 0) {
+        perror("sigprocmask");
+        exit(1);
+    }
+    
+    // The pipeline relay writes to pipes whose reader may be gone: take
+    // EPIPE rather than dying. Children get the original mask back.
+    sigset_t pipe_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_mask, NULL);
+    
+    // Fork the zygote before the shell allocates anything, so its image
+    // is as small as it will ever be
+    start_zygote();
+    
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || timer_fd < 0 || epoll_fd < 0) {
+        perror("event loop");
+        exit(1);
+    }
+    
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u64 = signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+    ev.data.u64 = timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+    wheel_base_ns = now_ns();
+    srandom(wheel_base_ns ^ getpid());  // Retry jitter
+    ev.data.u64 = STDIN_FILENO;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0) {
+        if (errno != EPERM) {
+            perror("epoll_ctl stdin");
+            exit(1);
+        }
+        stdin_polled = 0;
+    }
+    
+    // Initialize job table
+    init_job_table();
+}
+
+void print_prompt() {
+    printf("shell> ");
+    fflush(stdout);
+    at_prompt = 1;
+}
+
+// Wait up to timeout ms (-1 = forever) and handle whatever is ready
+void dispatch_events(int timeout) {
+    struct epoll_event events[MAX_EVENTS];
+    
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+        if (errno != EINTR) perror("epoll_wait");
+        return;
+    }
+    // Stands in for the exit time of any child reaped in this batch
+    wake_ns = now_ns();
+    
+    for (int i = 0; i < n; i++) {
+        uint64_t data = events[i].data.u64;
+        if (data & EV_PIDFD) {
+            reap_job((pid_t)(data & ~EV_PIDFD));
+        } else if (data & EV_STAGE) {
+            reap_stage((int)(uint32_t)(data >> 8), data & 0xff);
+        } else if (data & EV_RELAY) {
+            relay_pipe((int)(uint32_t)(data >> 8), data & 0xff);
+        } else if (data & EV_CAPTURE) {
+            capture_ready((int)(uint32_t)(data >> 8));
+        } else if (data == (EV_CONTROL | CONTROL_LISTENER)) {
+            control_accept();
+        } else if (data & EV_CONTROL) {
+            control_event((int)(uint32_t)data, events[i].events);
+        } else if (data == (uint64_t)signal_fd) {
+            handle_signals();
+        } else if (data == (uint64_t)timer_fd) {
+            wheel_expire();
+        } else if (data == STDIN_FILENO) {
+            read_input();
+        }
+    }
+    
+    if (control_replies) {
+        control_flush_all();
+    }
+    
+    // One prompt for the whole batch of job notices
+    if (notify_pending) {
+        notify_pending = 0;
+        if (at_prompt) print_prompt();
+    }
+    fflush(stdout);
+}
+
+// Read what stdin has and run every complete line in it
+void read_input() {
+    ssize_t n = read(STDIN_FILENO, input_buf + input_len,
+                     sizeof(input_buf) - 1 - input_len);
+    if (n < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            perror("read");
+            input_eof = 1;
+        }
+        return;
+    }
+    input_len += n;
+    
+    char *line = input_buf;
+    char *end = input_buf + input_len;
+    char *nl;
+    while ((nl = memchr(line, '\n', end - line)) != NULL) {
+        *nl = '\0';
+        if (input_skip) {
+            input_skip = 0;
+            print_prompt();
+        } else {
+            run_line(line);
+        }
+        line = nl + 1;
+    }
+    
+    // A line that fills the buffer is dropped up to its newline; a final
+    // line without one runs as-is
+    if (line == input_buf && input_len == (int)sizeof(input_buf) - 1) {
+        if (!input_skip) printf("Line too long\n");
+        input_skip = 1;
+        line = end;
+    } else if (line < end && n == 0) {
+        *end = '\0';
+        if (!input_skip) run_line(line);
+        line = end;
+    }
+    
+    input_len = end - line;
+    memmove(input_buf, line, input_len);
+    if (n == 0) input_eof = 1;
+}
+
+void run_line(char *line) {
+    char *args[MAX_ARGS];
+    int background;
+    
+    at_prompt = 0;
+    
+    // Skip empty lines
+    if (strlen(line) > 0) {
+        // Parse command
+        parse_command(line, args, &background);
+        
+        // Check for builtin commands, otherwise execute
+        if (!builtin_command(args)) {
+            execute_command(args, background);
+        }
+    }
     
-    // Initialize job queue
-    memset(jobs, 0, sizeof(jobs));
+    if (!input_eof) print_prompt();
 }
 
 void parse_command(char *line, char **args, int *background) {
+    static char pipe_token[] = "|";
     int i = 0;
     *background = 0;
     
@@ -129,145 +1262,4467 @@ void parse_command(char *line, char **args, int *background) {
             *background = 1;
             break;
         }
+        
+        // '|' is a token of its own even without spaces around it
+        char *bar = strchr(token, '|');
+        if (bar != NULL) {
+            *bar = '\0';
+            if (*token != '\0') args[i++] = token;
+            if (i < MAX_ARGS - 1) args[i++] = pipe_token;
+            token = bar[1] != '\0' ? bar + 1 : strtok(NULL, " \t");
+            continue;
+        }
         args[i++] = token;
         token = strtok(NULL, " \t");
     }
     args[i] = NULL;
 }
 
+// Redirection operators, longest first. fd -1 means stdout and stderr.
+static const struct {
+    const char *op;
+    int fd;
+    int flags;
+} redirects[] = {
+    { "&>", -1, O_WRONLY | O_CREAT | O_TRUNC },
+    { "2>", 2, O_WRONLY | O_CREAT | O_TRUNC },
+    { ">>", 1, O_WRONLY | O_CREAT | O_APPEND },
+    { ">", 1, O_WRONLY | O_CREAT | O_TRUNC },
+    { "<", 0, O_RDONLY },
+};
+
+// Index in redirects[] of the operator tok starts with, or -1. *file
+// points past the operator; it is empty when the file is the next token.
+static int redirect_op(const char *tok, const char **file) {
+    for (size_t r = 0; r < sizeof(redirects) / sizeof(redirects[0]); r++) {
+        size_t n = strlen(redirects[r].op);
+        if (strncmp(tok, redirects[r].op, n) == 0) {
+            *file = tok + n;
+            return r;
+        }
+    }
+    return -1;
+}
+
+// Open the redirections in argv and drop them from it, later ones
+// winning. fds[] gets the opened descriptors, -1 where there are none.
+// N>&M copies whatever M is at that point: an earlier redirection, else
+// base[M], else the shell's own M. Returns -1 after reporting an error.
+static int open_redirects(char **argv, const int base[3], int fds[3]) {
+    int kept = 0;
+    
+    fds[0] = fds[1] = fds[2] = -1;
+    for (int i = 0; argv[i] != NULL; i++) {
+        const char *file;
+        int r = redirect_op(argv[i], &file);
+        if (r < 0) {
+            argv[kept++] = argv[i];
+            continue;
+        }
+        if (*file == '\0') {
+            file = argv[++i];  // count_stages() made sure there is one
+        }
+        
+        int fd, fd2 = -1;
+        if (*file == '&') {
+            int from = file[1] - '0';
+            if (redirects[r].fd < 0 || from < 0 || from > 2 || file[2] != '\0') {
+                printf("%s: can only duplicate 0, 1 or 2\n", argv[i]);
+                goto fail;
+            }
+            int src = fds[from] >= 0 ? fds[from] : base[from] >= 0 ? base[from] : from;
+            fd = fcntl(src, F_DUPFD_CLOEXEC, 0);
+            if (fd < 0) {
+                perror(argv[i]);
+                goto fail;
+            }
+        } else {
+            fd = open(file, redirects[r].flags | O_CLOEXEC, 0666);
+            fd2 = (fd >= 0 && redirects[r].fd < 0) ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+            if (fd < 0 || (redirects[r].fd < 0 && fd2 < 0)) {
+                perror(file);
+                if (fd >= 0) close(fd);
+                goto fail;
+            }
+        }
+        
+        int target = redirects[r].fd < 0 ? 1 : redirects[r].fd;
+        if (fds[target] >= 0) close(fds[target]);
+        fds[target] = fd;
+        if (redirects[r].fd < 0) {
+            if (fds[2] >= 0) close(fds[2]);
+            fds[2] = fd2;
+        }
+    }
+    argv[kept] = NULL;
+    return 0;
+    
+fail:
+    for (int k = 0; k < 3; k++) {
+        if (fds[k] >= 0) close(fds[k]);
+    }
+    return -1;
+}
+
+// Number of stages in a command split by "|" tokens, -1 if one has no
+// command word or a redirection has no file
+static int count_stages(char **args) {
+    int stages = 1;
+    int words = 0;
+    
+    for (int i = 0; args[i] != NULL; i++) {
+        const char *file;
+        if (strcmp(args[i], "|") == 0) {
+            if (words == 0) return -1;
+            stages++;
+            words = 0;
+        } else if (redirect_op(args[i], &file) >= 0) {
+            if (*file != '\0') continue;
+            if (args[i + 1] == NULL || strcmp(args[i + 1], "|") == 0) return -1;
+            i++;
+        } else {
+            words++;
+        }
+    }
+    return words > 0 ? stages : -1;
+}
+
+// Enter a background job, not yet started, with everything opts asks
+// for. job_id 0 takes the next job id. NULL after reporting an error.
+static job_t* create_job(int job_id, char **args, const char *cmd, const job_opts_t *opts,
+                         int auto_sched) {
+    job_t *job = add_job(job_id, 0, -1, cmd, QUEUED);
+    if (job == NULL) {
+        return NULL;
+    }
+    
+    // Keep argv so a queued job can be launched without re-parsing
+    job_info_t *info = job_info(job);
+    size_t len = 0;
+    for (info->argc = 0; args[info->argc] != NULL; info->argc++) {
+        len += strlen(args[info->argc]) + 1;
+    }
+    info->argv = malloc(len);
+    if (info->argv == NULL) {
+        printf("Job table: out of memory\n");
+        delete_job(job);
+        return NULL;
+    }
+    char *p = info->argv;
+    for (int i = 0; i < info->argc; i++) {
+        p = stpcpy(p, args[i]) + 1;
+    }
+    info->priority = opts->priority;
+    info->node_req = opts->node >= 0 ? numa_index(opts->node) : -1;
+    info->sched = opts->sched;
+    info->auto_sched = auto_sched;
+    info->timeout_ns = opts->timeout_ns;
+    info->deadline_ns = opts->deadline_ns;
+    if (opts->retry.retries > 0) {
+        info->retry = malloc(sizeof(job_retry_t));
+        if (info->retry == NULL) {
+            printf("Job table: out of memory\n");
+            delete_job(job);
+            return NULL;
+        }
+        *info->retry = opts->retry;
+    }
+    
+    if (opts->output != NULL) {
+        // Opened when the job launches, like its redirections
+        size_t n = strlen(opts->output) + 1;
+        info->output = malloc(sizeof(job_output_t) + n);
+        if (info->output == NULL) {
+            printf("Job table: out of memory\n");
+            delete_job(job);
+            return NULL;
+        }
+        info->output->path = memcpy(info->output + 1, opts->output, n);
+        info->output->pipe_size = opts->pipe_size;
+        info->output->prealloc = opts->prealloc;
+        info->output->relay.in = info->output->relay.out = -1;
+    }
+    
+    // Made now so a missing controller is reported at submission; queued
+    // jobs keep theirs until they run
+    int use_cgroup = opts->cgroup != NULL;
+    for (int i = 0; i < CG_LIMITS; i++) {
+        if (opts->limits[i][0] != '\0') use_cgroup = 1;
+    }
+    if (use_cgroup) {
+        info->cgroup = cgroup_get(job->job_id, opts);
+        if (info->cgroup == NULL) {
+            delete_job(job);
+            return NULL;
+        }
+    }
+    return job;
+}
+
+// "<first>-<last>" with an optional "%<limit>"; -1 if malformed
+static int parse_range(const char *str, int *first, int *last, int *limit) {
+    char *end;
+    long a = strtol(str, &end, 10);
+    if (end == str || *end != '-') return -1;
+    const char *b_str = end + 1;
+    long b = strtol(b_str, &end, 10);
+    if (end == b_str || a < 0 || b < a || b - a >= ARRAY_MAX_ELEMENTS) return -1;
+    
+    long l = 0;
+    if (*end == '%') {
+        const char *l_str = end + 1;
+        l = strtol(l_str, &end, 10);
+        if (end == l_str || l <= 0 || l > INT_MAX) return -1;
+    }
+    if (*end != '\0') return -1;
+    
+    *first = a;
+    *last = b;
+    *limit = l;
+    return 0;
+}
+
+// Open path as a source of items; NULL after reporting an error
+static item_reader_t* reader_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    item_reader_t *r = malloc(sizeof(item_reader_t) + PARALLEL_BUF_SIZE + 1);
+    if (r == NULL) {
+        printf("parallel: out of memory\n");
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    r->eof = 0;
+    r->error = 0;
+    r->start = r->end = 0;
+    return r;
+}
+
+static void reader_close(item_reader_t *r) {
+    if (r == NULL) return;
+    close(r->fd);
+    free(r);
+}
+
+// Next non-empty line, NUL-terminated in place; valid until the next
+// call. NULL at the end of the input or after a read error. A line
+// longer than the buffer is cut into buffer-sized items.
+static char* reader_next(item_reader_t *r, size_t *len) {
+    for (;;) {
+        char *line = r->buf + r->start;
+        char *nl = memchr(line, '\n', r->end - r->start);
+        if (nl != NULL || (r->eof && r->end > r->start) ||
+            (r->start == 0 && r->end == PARALLEL_BUF_SIZE)) {
+            char *stop = nl ? nl : r->buf + r->end;
+            *stop = '\0';
+            r->start = nl ? (size_t)(nl - r->buf) + 1 : r->end;
+            *len = stop - line;
+            if (*len == 0) continue;
+            return line;
+        }
+        if (r->eof) return NULL;
+        
+        // Keep the partial line, then refill behind it
+        memmove(r->buf, line, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        ssize_t n = read(r->fd, r->buf + r->end, PARALLEL_BUF_SIZE - r->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) r->error = errno;
+        if (n <= 0) r->eof = 1;
+        if (n > 0) r->end += n;
+    }
+}
+
+// parallel's own options: [-j <jobs>] [-n <items>] [-a <file>], and a
+// "<" redirection anywhere after them, which is where the items come
+// from rather than every command's stdin. tmpl gets the command
+// template. Returns the item source, NULL after reporting an error.
+static item_reader_t* parse_parallel(char **args, int *jobs, int *batch, char **tmpl) {
+    const char *file = NULL;
+    int i = 1;
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    *jobs = cpus > 0 ? cpus : 1;
+    *batch = 1;
+    while (args[i] != NULL && args[i][0] == '-') {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL && atoi(args[i + 1]) > 0) {
+            *jobs = atoi(args[i + 1]);
+        } else if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL && atoi(args[i + 1]) > 0) {
+            *batch = atoi(args[i + 1]);
+        } else if (strcmp(args[i], "-a") == 0 && args[i + 1] != NULL) {
+            file = args[i + 1];
+        } else {
+            break;
+        }
+        i += 2;
+    }
+    
+    int n = 0;
+    for (; args[i] != NULL; i++) {
+        const char *path;
+        int r = redirect_op(args[i], &path);
+        if (r >= 0 && redirects[r].fd == 0) {
+            file = *path ? path : args[++i];  // count_stages() made sure there is one
+        } else {
+            tmpl[n++] = args[i];
+        }
+    }
+    tmpl[n] = NULL;
+    
+    if (n == 0) {
+        printf("Usage: [options] parallel [-j <jobs>] [-n <items>] [-a <file>] <command> [{}] < <file>\n");
+        return NULL;
+    }
+    // Every item may become a word of its own
+    if (n + *batch >= MAX_ARGS) {
+        printf("parallel: -n %d: at most %d items with a %d-word command\n", *batch,
+               MAX_ARGS - 1 - n, n);
+        return NULL;
+    }
+    // The shell's own stdin is where its commands come from
+    if (file == NULL) {
+        printf("parallel: give the items with < <file> or -a <file>\n");
+        return NULL;
+    }
+    return reader_open(file);
+}
+
 int execute_command(char **args, int background) {
-    pid_t pid;
+    job_opts_t opts;
+    int skip = parse_job_opts(args, &opts);
     
+    if (skip < 0) return 0;
+    args += skip;
     if (args[0] == NULL) return 1;
     
-    pid = fork();
+    int nstages = count_stages(args);
+    if (nstages < 0) {
+        printf("Syntax error: empty command or missing redirection file\n");
+        return 0;
+    }
+    
+    // array <first>-<last>[%<limit>] <command>: the command once per index
+    int array = strcmp(args[0], "array") == 0;
+    int first = 0, last = 0, limit = 0;
+    if (array) {
+        if (args[1] == NULL || args[2] == NULL || parse_range(args[1], &first, &last, &limit) < 0) {
+            printf("Usage: [options] array <first>-<last>[%%<limit>] <command with {}> &\n");
+            return 0;
+        }
+        if (!background) {
+            printf("array: only for background jobs (&)\n");
+            return 0;
+        }
+    }
+    // parallel [-j <jobs>] [-n <items>] <command> < <file>: the command
+    // once per batch of lines. Its jobs always run in the background; the
+    // shell waits for them all unless it is given "&".
+    int parallel = strcmp(args[0], "parallel") == 0;
+    int wait = parallel && !background;
+    if (parallel) background = 1;
+    
+    if (opts.ndeps > 0 && !background) {
+        printf("after: dependent jobs must run in the background (&)\n");
+        return 0;
+    }
+    if (opts.output != NULL && !background) {
+        printf("-o: only for background jobs (&); use > or &> instead\n");
+        return 0;
+    }
+    int use_cgroup = opts.cgroup != NULL;
+    for (int i = 0; i < CG_LIMITS; i++) {
+        if (opts.limits[i][0] != '\0') use_cgroup = 1;
+    }
+    if (use_cgroup && !background) {
+        printf("cgroup limits: only for background jobs (&)\n");
+        return 0;
+    }
+    if ((opts.timeout_ns || opts.deadline_ns || opts.retry.retries) && !background) {
+        printf("--timeout, --deadline, --retry: only for background jobs (&)\n");
+        return 0;
+    }
+    // Raising priority needs privileges; refuse rather than have the child
+    // quietly keep the shell's nice value
+    if (opts.sched.set & JOB_SCHED_NICE) {
+        struct rlimit nice_limit;
+        getrlimit(RLIMIT_NICE, &nice_limit);
+        errno = 0;
+        int shell_nice = getpriority(PRIO_PROCESS, 0);
+        if (opts.sched.nice < shell_nice && geteuid() != 0 &&
+            nice_limit.rlim_cur != RLIM_INFINITY &&
+            (rlim_t)(20 - opts.sched.nice) > nice_limit.rlim_cur) {
+            printf("--nice %d: not permitted below the shell's %d\n", opts.sched.nice, shell_nice);
+            return 0;
+        }
+    }
+    int auto_sched = 0;
+    if (background && bg_policy != SCHED_OTHER &&
+        !(opts.sched.set & (JOB_SCHED_POLICY | JOB_SCHED_IOPRIO))) {
+        int nice = opts.sched.nice;
+        int set = opts.sched.set;
+        sched_class(bg_policy, &opts.sched);
+        opts.sched.nice = nice;
+        opts.sched.set |= set;
+        auto_sched = 1;
+    }
+    
+    if (opts.node >= 0) {
+        if (!background) {
+            printf("--node: only for background jobs (&)\n");
+            return 0;
+        }
+        if (numa_load() < 0) return 0;
+        if (numa_index(opts.node) < 0) {
+            printf("No such NUMA node with usable CPUs: %d\n", opts.node);
+            return 0;
+        }
+    }
+    
+    // Resolve dependencies up front so a bad id leaves nothing behind.
+    // A missing job that was submitted earlier has already finished.
+    job_t *parents[MAX_DEPS];
+    for (int i = 0; i < opts.ndeps; i++) {
+        int dep_id = opts.deps[i].job_id;
+        parents[i] = find_job_by_id(dep_id);
+        if (parents[i] != NULL) continue;
+        if (dep_id <= 0 || dep_id >= next_job_id) {
+            printf("Job [%d] not found\n", dep_id);
+            return 0;
+        }
+        if (opts.deps[i].need_ok) {
+            printf("afterok: job [%d] already finished, exit status unknown\n", dep_id);
+            return 0;
+        }
+    }
+    
+    // Split-out '|' tokens gain a space each, so this can outgrow the line
+    char cmd[MAX_LINE] = "";
+    size_t cmd_len = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        int n = snprintf(cmd + cmd_len, sizeof(cmd) - cmd_len, "%s ", args[i]);
+        if (n < 0 || (size_t)n >= sizeof(cmd) - cmd_len) {
+            printf("Command too long\n");
+            return 0;
+        }
+        cmd_len += n;
+    }
+    
+    char *tmpl[MAX_ARGS];
+    item_reader_t *input = NULL;
+    int batch = 0;
+    if (parallel) {
+        input = parse_parallel(args, &limit, &batch, tmpl);
+        if (input == NULL) return 0;
+    }
+    
+    if (!background && nstages == 1) {
+        // Foreground job: never queued
+        spawn_req_t req = { .argv = args, .fds = { -1, -1, -1 },
+                            .sched = opts.sched.set ? &opts.sched : NULL };
+        pid_t pid;
+        int pidfd;
+        if (start_child(&req, 0, &pid, &pidfd) < 0) {
+            return 0;
+        }
+        perf_attach(pid, &fg_perf);
+        fg_command = str_intern(cmd);
+        fg_started_ns = now_ns();
+        wait_for_fg(pid, pidfd);
+        return 1;
+    }
+    
+    // Background job: always enters the table, queued if over the limit
+    job_t *job;
+    if (array) {
+        job = array_submit(args + 2, cmd, &opts, auto_sched, first, last, limit, NULL, 0);
+    } else if (parallel) {
+        job = array_submit(tmpl, cmd, &opts, auto_sched, 1, INT_MAX, limit, input, batch);
+    } else {
+        job = create_job(0, args, cmd, &opts, auto_sched);
+    }
+    if (job == NULL) {
+        reader_close(input);
+        return 0;
+    }
+    job_info_t *info = job_info(job);
+    
+    if (!background) {
+        // Foreground pipeline: in the table so every stage gets reaped, but
+        // in the shell's process group like any foreground command
+        if (launch_pipeline(job, args, 0) < 0) {
+            delete_job(job);
+            return 0;
+        }
+        wait_for_fg(job->pid, -1);
+        return 1;
+    }
+    
+    for (int i = 0; i < opts.ndeps; i++) {
+        if (parents[i] != NULL && add_dependency(parents[i], job, opts.deps[i].need_ok) < 0) {
+            // Edges already added point at a job id that will never exist
+            // again, so they are skipped when their parent finishes
+            printf("Job table: out of memory\n");
+            delete_job(job);
+            return 0;
+        }
+    }
+    // A deadline counts while the job waits too
+    job_timer_start(job);
+    if (info->deps_left > 0) {
+        job->state = WAITING;
+        printf("[%d] Waiting: %s\n", job->job_id, cmd);
+        if (wait) wait_for_array(job->job_id);
+        return 1;
+    }
+    
+    if (array || parallel) {
+        // Elements start quietly; failures are reported as they happen
+        int job_id = job->job_id;
+        if (array) {
+            printf("[%d] Array of %d: %s\n", job_id, last - first + 1, cmd);
+        } else if (!wait) {
+            printf("[%d] Parallel: %s\n", job_id, cmd);
+        }
+        array_update(job_id);
+        dispatch_queued();
+        notify_pending = 0;
+        if (wait) wait_for_array(job_id);
+        return 1;
+    }
+    
+    if (max_running > 0 && active_jobs >= max_running) {
+        if (enqueue_job(job) < 0) {
+            printf("Job table: out of memory\n");
+            delete_job(job);
+            return 0;
+        }
+        printf("[%d] Queued: %s\n", job->job_id, cmd);
+        return 1;
+    }
+    
+    int job_id = job->job_id;
+    if (launch_job(job) < 0) {
+        return 0;
+    }
+    printf("[%d] %d %s\n", job_id, job->pid, cmd);
+    return 1;
+}
+
+// Byte count with an optional K, M or G suffix (powers of 1024); -1 if
+// malformed
+static long long parse_size(const char *str) {
+    char *end;
+    long long n = strtoll(str, &end, 10);
+    int shift = 0;
+    
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (end == str || *end != '\0' || n < 0 || n > (LLONG_MAX >> shift)) return -1;
+    return n << shift;
+}
+
+// Size a pipe can actually be given: the kernel rounds up to a power of
+// two pages and caps unprivileged users at fs.pipe-max-size. Tried on a
+// scratch pipe; -1 after reporting an error.
+static int check_pipe_size(long long size) {
+    int fds[2];
+    
+    if (size > INT_MAX) {
+        errno = EINVAL;
+    } else if (pipe(fds) == 0) {
+        int got = fcntl(fds[1], F_SETPIPE_SZ, (int)size);
+        close(fds[0]);
+        close(fds[1]);
+        if (got >= 0) return got;
+    }
+    perror("pipe size");
+    return -1;
+}
+
+// --cpu-max <cpus>: that many CPUs' worth of time per 100ms, or "max"
+static int parse_cpu_max(const char *str, char *buf, size_t n) {
+    char *end;
+    double cpus = strtod(str, &end);
+    if (strcmp(str, "max") == 0) {
+        snprintf(buf, n, "max 100000");
+        return 0;
+    }
+    // The kernel's smallest quota is 1ms
+    if (end == str || *end != '\0' || !(cpus >= 0.01 && cpus <= 4096)) return -1;
+    snprintf(buf, n, "%lld 100000", (long long)(cpus * 100000 + 0.5));
+    return 0;
+}
+
+// --mem-max <bytes>, with K/M/G suffixes, or "max"
+static int parse_mem_max(const char *str, char *buf, size_t n) {
+    long long bytes = strcmp(str, "max") == 0 ? LLONG_MAX : parse_size(str);
+    if (bytes <= 0) return -1;
+    if (bytes == LLONG_MAX) {
+        snprintf(buf, n, "max");
+    } else {
+        snprintf(buf, n, "%lld", bytes);
+    }
+    return 0;
+}
+
+// --io-weight <1-10000>
+static int parse_io_weight(const char *str, char *buf, size_t n) {
+    char *end;
+    long weight = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || weight < 1 || weight > 10000) return -1;
+    snprintf(buf, n, "default %ld", weight);
+    return 0;
+}
+
+// normal|batch|idle, as a scheduling policy; -1 if none of them
+static int parse_policy(const char *str) {
+    if (strcmp(str, "normal") == 0) return SCHED_OTHER;
+    if (strcmp(str, "batch") == 0) return SCHED_BATCH;
+    if (strcmp(str, "idle") == 0) return SCHED_IDLE;
+    return -1;
+}
+
+// --ioprio idle|be[:<0-7>]; -1 if neither. Real-time needs privileges the
+// shell does not assume.
+static int parse_ioprio(const char *str) {
+    if (strcmp(str, "idle") == 0) return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+    if (strncmp(str, "be", 2) != 0) return -1;
+    if (str[2] == '\0') return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 4);
+    if (str[2] == ':' && str[3] >= '0' && str[3] <= '7' && str[4] == '\0') {
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, str[3] - '0');
+    }
+    return -1;
+}
+
+// Duration: a number with an optional ms, s, m or h suffix (seconds if
+// none); -1 if malformed or not positive
+static int64_t parse_duration(const char *str) {
+    char *end;
+    double n = strtod(str, &end);
+    double unit = 1e9;
+    
+    if (strcmp(end, "ms") == 0) {
+        unit = 1e6;
+    } else if (strcmp(end, "m") == 0) {
+        unit = 60e9;
+    } else if (strcmp(end, "h") == 0) {
+        unit = 3600e9;
+    } else if (*end != '\0' && strcmp(end, "s") != 0) {
+        return -1;
+    }
+    // Past a year is as good as never
+    if (end == str || !(n * unit >= 1e6 && n * unit <= 366 * 86400e9)) return -1;
+    return (int64_t)(n * unit);
+}
+
+// --deadline HH:MM[:SS]: the next time the clock reads that, as
+// CLOCK_MONOTONIC; -1 if malformed
+static int64_t parse_deadline(const char *str) {
+    int hour, min, sec = 0, len = 0;
+    sscanf(str, "%2d:%2d%n:%2d%n", &hour, &min, &len, &sec, &len);
+    if (len == 0 || str[len] != '\0' || hour < 0 || hour > 23 || min < 0 || min > 59 ||
+        sec < 0 || sec > 59) {
+        return -1;
+    }
+    
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_hour = hour;
+    tm.tm_min = min;
+    tm.tm_sec = sec;
+    tm.tm_isdst = -1;
+    time_t when = mktime(&tm);
+    if (when <= now) {
+        tm.tm_mday++;
+        tm.tm_hour = hour;
+        tm.tm_min = min;
+        tm.tm_sec = sec;
+        tm.tm_isdst = -1;
+        when = mktime(&tm);
+    }
+    return now_ns() + (int64_t)(when - now) * 1000000000;
+}
+
+// --backoff <base>[,<max>]; -1 if malformed
+static int parse_backoff(const char *str, job_retry_t *r) {
+    char base[64];
+    const char *comma = strchr(str, ',');
+    size_t len = comma ? (size_t)(comma - str) : strlen(str);
+    
+    if (len >= sizeof(base)) return -1;
+    memcpy(base, str, len);
+    base[len] = '\0';
+    int64_t base_ns = parse_duration(base);
+    int64_t max_ns = comma ? parse_duration(comma + 1) : r->max_ns;
+    if (base_ns < 0 || max_ns < base_ns) return -1;
+    r->base_ns = base_ns;
+    r->max_ns = max_ns;
+    return 0;
+}
+
+// --retry-on <status>[,<status>...], each 1-255; -1 if malformed
+static int parse_statuses(const char *str, uint32_t statuses[8]) {
+    memset(statuses, 0, 8 * sizeof(statuses[0]));
+    for (;;) {
+        char *end;
+        long status = strtol(str, &end, 10);
+        if (end == str || (*end != ',' && *end != '\0') || status < 1 || status > 255) {
+            return -1;
+        }
+        statuses[status / 32] |= 1u << (status % 32);
+        if (*end == '\0') return 0;
+        str = end + 1;
+    }
+}
+
+// --cgroup <name>: letters, digits, '-', '_' and '.', at most 64
+static int valid_cgroup_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > 64 || name[0] == '.') return 0;
+    return strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                        "0123456789-_.") == len;
+}
+
+// Consume leading scheduler options; returns how many tokens they took,
+// or -1 after printing usage
+int parse_job_opts(char **args, job_opts_t *opts) {
+    int i = 0;
+    
+    int retry_opts = 0;
+    
+    memset(opts, 0, sizeof(*opts));
+    opts->node = -1;
+    opts->retry.any_failure = 1;
+    opts->retry.base_ns = 1000000000LL;
+    opts->retry.max_ns = 60000000000LL;
+    while (args[i] != NULL && (args[i][0] == '-' || strcmp(args[i], "after") == 0 ||
+                               strcmp(args[i], "afterok") == 0)) {
+        if (strcmp(args[i], "-p") == 0 && args[i + 1] != NULL) {
+            opts->priority = atoi(args[i + 1]);
+            i += 2;
+        } else if (strcmp(args[i], "-o") == 0 && args[i + 1] != NULL) {
+            opts->output = args[i + 1];
+            i += 2;
+        } else if (strcmp(args[i], "--pipe-size") == 0 && args[i + 1] != NULL &&
+                   parse_size(args[i + 1]) > 0) {
+            opts->pipe_size = check_pipe_size(parse_size(args[i + 1]));
+            if (opts->pipe_size < 0) return -1;
+            i += 2;
+        } else if (strcmp(args[i], "--prealloc") == 0 && args[i + 1] != NULL &&
+                   parse_size(args[i + 1]) >= 0) {
+            opts->prealloc = parse_size(args[i + 1]);
+            i += 2;
+        } else if (strcmp(args[i], "--cpu-max") == 0 && args[i + 1] != NULL &&
+                   parse_cpu_max(args[i + 1], opts->limits[CG_CPU_MAX],
+                                 sizeof(opts->limits[0])) == 0) {
+            i += 2;
+        } else if (strcmp(args[i], "--mem-max") == 0 && args[i + 1] != NULL &&
+                   parse_mem_max(args[i + 1], opts->limits[CG_MEM_MAX],
+                                 sizeof(opts->limits[0])) == 0) {
+            i += 2;
+        } else if (strcmp(args[i], "--io-weight") == 0 && args[i + 1] != NULL &&
+                   parse_io_weight(args[i + 1], opts->limits[CG_IO_WEIGHT],
+                                   sizeof(opts->limits[0])) == 0) {
+            i += 2;
+        } else if (strcmp(args[i], "--sched") == 0 && args[i + 1] != NULL &&
+                   parse_policy(args[i + 1]) >= 0) {
+            opts->sched.policy = parse_policy(args[i + 1]);
+            opts->sched.set |= JOB_SCHED_POLICY;
+            i += 2;
+        } else if (strcmp(args[i], "--nice") == 0 && args[i + 1] != NULL &&
+                   atoi(args[i + 1]) >= -20 && atoi(args[i + 1]) <= 19) {
+            opts->sched.nice = atoi(args[i + 1]);
+            opts->sched.set |= JOB_SCHED_NICE;
+            i += 2;
+        } else if (strcmp(args[i], "--ioprio") == 0 && args[i + 1] != NULL &&
+                   parse_ioprio(args[i + 1]) >= 0) {
+            opts->sched.ioprio = parse_ioprio(args[i + 1]);
+            opts->sched.set |= JOB_SCHED_IOPRIO;
+            i += 2;
+        } else if (strcmp(args[i], "--timeout") == 0 && args[i + 1] != NULL &&
+                   parse_duration(args[i + 1]) > 0) {
+            opts->timeout_ns = parse_duration(args[i + 1]);
+            i += 2;
+        } else if (strcmp(args[i], "--deadline") == 0 && args[i + 1] != NULL &&
+                   parse_deadline(args[i + 1]) > 0) {
+            opts->deadline_ns = parse_deadline(args[i + 1]);
+            i += 2;
+        } else if (strcmp(args[i], "--retry") == 0 && args[i + 1] != NULL &&
+                   atoi(args[i + 1]) > 0 && atoi(args[i + 1]) <= 1000) {
+            opts->retry.retries = atoi(args[i + 1]);
+            i += 2;
+        } else if (strcmp(args[i], "--backoff") == 0 && args[i + 1] != NULL &&
+                   parse_backoff(args[i + 1], &opts->retry) == 0) {
+            retry_opts = 1;
+            i += 2;
+        } else if (strcmp(args[i], "--retry-on") == 0 && args[i + 1] != NULL &&
+                   parse_statuses(args[i + 1], opts->retry.statuses) == 0) {
+            opts->retry.any_failure = 0;
+            retry_opts = 1;
+            i += 2;
+        } else if (strcmp(args[i], "--node") == 0 && args[i + 1] != NULL &&
+                   atoi(args[i + 1]) >= 0) {
+            opts->node = atoi(args[i + 1]);
+            i += 2;
+        } else if (strcmp(args[i], "--cgroup") == 0 && args[i + 1] != NULL &&
+                   valid_cgroup_name(args[i + 1])) {
+            opts->cgroup = args[i + 1];
+            i += 2;
+        } else if (args[i][0] == 'a' && args[i + 1] != NULL) {
+            // after|afterok <id>[,<id>...]
+            int need_ok = strcmp(args[i], "afterok") == 0;
+            const char *p = args[i + 1];
+            for (;;) {
+                char *end;
+                long dep_id = strtol(p, &end, 10);
+                if (end == p || (*end != ',' && *end != '\0') || opts->ndeps == MAX_DEPS) {
+                    printf("%s: bad job list: %s\n", args[i], args[i + 1]);
+                    return -1;
+                }
+                opts->deps[opts->ndeps].job_id = (int)dep_id;
+                opts->deps[opts->ndeps++].need_ok = need_ok;
+                if (*end == '\0') break;
+                p = end + 1;
+            }
+            i += 2;
+        } else {
+            printf("Unknown option: %s\n", args[i]);
+            printf("Usage: [-p <prio>] [-o <file> [--pipe-size <n>] [--prealloc <n>]]\n"
+                   "       [--cpu-max <cpus>] [--mem-max <bytes>] [--io-weight <1-10000>]\n"
+                   "       [--cgroup <name>] [--node <id>] [--sched normal|batch|idle]\n"
+                   "       [--nice <n>] [--ioprio idle|be[:0-7]] [--timeout <duration>]\n"
+                   "       [--deadline <HH:MM>] [--retry <n> [--backoff <base>[,<max>]]\n"
+                   "       [--retry-on <status>[,<status>...]]] [after|afterok <id>[,<id>...]]\n"
+                   "       <command> [&]\n");
+            return -1;
+        }
+    }
+    if ((opts->pipe_size || opts->prealloc) && opts->output == NULL) {
+        printf("--pipe-size and --prealloc need -o <file>\n");
+        return -1;
+    }
+    if (retry_opts && opts->retry.retries == 0) {
+        printf("--backoff and --retry-on need --retry <n>\n");
+        return -1;
+    }
+    return i;
+}
+
+// Spawn req and start watching its pidfd under the given epoll tag (0 =
+// EV_PIDFD | pid). Reports errors itself.
+int start_child(spawn_req_t *req, uint64_t tag, pid_t *pid, int *pidfd) {
+    char **argv = req->argv;
+    int redir[3];
+    
+    // Redirections in the command override the fds the caller set up;
+    // the child has its own copies once spawned
+    if (open_redirects(argv, req->fds, redir) < 0) {
+        return -1;
+    }
+    req->path = resolve_command(argv[0]);
+    if (req->path != NULL) {
+        for (int fd = 0; fd < 3; fd++) {
+            if (redir[fd] >= 0) req->fds[fd] = redir[fd];
+        }
+        // Every backend returns once the child has exec'd
+        int64_t start = now_ns();
+        *pid = spawn_child(req);
+        if (*pid > 0) latency_record(&launch_latency, now_ns() - start);
+    }
+    int err = errno;
+    for (int fd = 0; fd < 3; fd++) {
+        if (redir[fd] >= 0) close(redir[fd]);
+    }
+    errno = err;
+    
+    if (req->path == NULL) {
+        printf("Command not found: %s\n", argv[0]);
+        return -1;
+    }
+    if (*pid < 0) {
+        if (errno == ENOENT) {
+            printf("Command not found: %s\n", argv[0]);
+        } else {
+            perror(argv[0]);
+        }
+        return -1;
+    }
+    
+    // The child stays our unreaped zombie until we wait on it, so its
+    // pid cannot be recycled before the pidfd is taken
+    *pidfd = pidfd_open(*pid, 0);
+    if (*pidfd < 0 || watch_child(tag ? tag : EV_PIDFD | (uint32_t)*pid, *pidfd) < 0) {
+        perror("pidfd");
+        if (*pidfd >= 0) {
+            discard_child(*pidfd);
+        } else {
+            kill(*pid, SIGKILL);
+            waitpid(*pid, NULL, 0);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Pipe for a pipeline link; close-on-exec, since children only ever get
+// one end through dup2
+static int open_pipe(int fds[2]) {
+    if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+    if (pipe_size > 0) {
+        // Best effort: 'set pipesize' already checked the size is allowed
+        fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+    }
+    return 0;
+}
+
+static void relay_close(relay_t *relay) {
+    // Closing drops the fds from the epoll set
+    if (relay->in >= 0) close(relay->in);
+    if (relay->out >= 0) close(relay->out);
+    relay->in = relay->out = -1;
+}
+
+// Hand a relay link's ends to the event loop. Edge-triggered: a splice
+// that would block is retried when either side changes. A regular file
+// (an output file) cannot be polled and is always writable anyway.
+static int relay_watch(relay_t *relay, uint64_t tag) {
+    struct epoll_event in_ev = { .events = EPOLLIN | EPOLLET };
+    struct epoll_event out_ev = { .events = EPOLLOUT | EPOLLET };
+    in_ev.data.u64 = out_ev.data.u64 = tag;
+    
+    if (fcntl(relay->in, F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(relay->out, F_SETFL, O_NONBLOCK) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, relay->in, &in_ev) < 0 ||
+        (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, relay->out, &out_ev) < 0 && errno != EPERM)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Move whatever a relay link can take right now, without copying through
+// user space. Closes the link once the upstream side is done.
+static void relay_move(relay_t *relay) {
+    while (relay->in >= 0) {
+        ssize_t n = splice(relay->in, NULL, relay->out, NULL, RELAY_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        // Upstream empty or downstream full: wait for the next edge
+        if (n < 0 && errno == EAGAIN) return;
+        
+        // Upstream closed (EOF passes on to the next stage), downstream
+        // gone (the writer gets EPIPE), or a real error
+        relay_close(relay);
+    }
+}
+
+// Ring for a job's output: a memfd mapped twice in a row, so reads and
+// writes never have to split at the wrap point
+static capture_t* capture_new(int job_id, size_t size) {
+    size_t cap = sysconf(_SC_PAGESIZE);
+    while (cap < size) cap *= 2;
+    
+    capture_t *c = calloc(1, sizeof(*c));
+    int mfd = memfd_create("job-output", MFD_CLOEXEC);
+    char *base = MAP_FAILED;
+    if (c != NULL && mfd >= 0 && ftruncate(mfd, cap) == 0) {
+        // Reserve both halves, then map the memfd over each
+        base = mmap(NULL, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base != MAP_FAILED &&
+            (mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, mfd, 0) == MAP_FAILED ||
+             mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, mfd, 0) == MAP_FAILED)) {
+            munmap(base, 2 * cap);
+            base = MAP_FAILED;
+        }
+    }
+    if (mfd >= 0) close(mfd);
+    if (base == MAP_FAILED) {
+        perror("capture");
+        free(c);
+        return NULL;
+    }
+    
+    c->job_id = job_id;
+    c->fd = -1;
+    c->ring = base;
+    c->cap = cap;
+    c->spill_fd = -1;
+    return c;
+}
+
+static void capture_free(capture_t *c) {
+    if (c == NULL) return;
+    if (c->fd >= 0) close(c->fd);
+    if (c->spill_fd >= 0) close(c->spill_fd);
+    munmap(c->ring, 2 * c->cap);
+    free(c);
+}
+
+// Move the oldest n bytes out of the ring, to the spill file while that
+// keeps working
+static void capture_spill(capture_t *c, size_t n) {
+    if (c->spill_fd < 0 && c->spilled == c->head) {
+        const char *dir = getenv("TMPDIR");
+        c->spill_fd = open(dir && *dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (c->spill_fd < 0) {
+            printf("\n[%d] Output spill failed, dropping old output: %s\n",
+                   c->job_id, strerror(errno));
+            notify_pending = 1;
+        }
+    }
+    
+    // Once anything is lost the file no longer lines up with the offsets,
+    // so only append while nothing has been
+    const char *p = c->ring + (c->head & (c->cap - 1));
+    size_t done = 0;
+    while (c->spill_fd >= 0 && c->spilled == c->head && done < n) {
+        ssize_t w = write(c->spill_fd, p + done, n - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        done += w;
+    }
+    if (done == n) c->spilled += n;
+    c->head += n;
+}
+
+// Read what the job's pipe holds straight into the ring
+static void capture_read(capture_t *c) {
+    while (c->fd >= 0) {
+        if (c->tail - c->head == c->cap) {
+            capture_spill(c, c->cap / 2);
+        }
+        size_t room = c->cap - (c->tail - c->head);
+        ssize_t n = read(c->fd, c->ring + (c->tail & (c->cap - 1)), room);
+        if (n > 0) {
+            c->tail += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        
+        // EOF: every writer is gone (closing drops it from the epoll set)
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+// Capture of a live or recently finished job, NULL if there is none
+static capture_t* find_capture(int job_id) {
+    job_t *job = find_job_by_id(job_id);
+    if (job != NULL) return job_info(job)->capture;
+    
+    for (int i = 0; i < CAPTURE_KEEP; i++) {
+        if (done_captures[i] != NULL && done_captures[i]->job_id == job_id) {
+            return done_captures[i];
+        }
+    }
+    return NULL;
+}
+
+// A job left the table: collect what its pipe still holds and keep the
+// capture viewable among the last CAPTURE_KEEP
+static void capture_retire(capture_t *c) {
+    if (c == NULL) return;
+    capture_read(c);
+    if (c->fd >= 0) {
+        // Something the job started still has the pipe open
+        close(c->fd);
+        c->fd = -1;
+    }
+    capture_free(done_captures[done_capture_next]);
+    done_captures[done_capture_next] = c;
+    done_capture_next = (done_capture_next + 1) % CAPTURE_KEEP;
+}
+
+// Write [from, tail) of a capture to stdout; returns the new end
+static uint64_t capture_print(capture_t *c, uint64_t from) {
+    static char buf[CAPTURE_IO_SIZE];
+    
+    fflush(stdout);
+    while (from < c->spilled) {
+        size_t n = c->spilled - from < sizeof(buf) ? c->spilled - from : sizeof(buf);
+        ssize_t r = pread(c->spill_fd, buf, n, from);
+        if (r <= 0) break;
+        if (write(STDOUT_FILENO, buf, r) < 0) break;
+        from += r;
+    }
+    if (from < c->head) {
+        printf("[... %llu bytes lost ...]\n", (unsigned long long)(c->head - from));
+        fflush(stdout);
+        from = c->head;
+    }
+    if (from < c->tail &&
+        write(STDOUT_FILENO, c->ring + (from & (c->cap - 1)), c->tail - from) < 0) {
+        return from;
+    }
+    return c->tail;
+}
+
+// Offset at which the last n lines of a capture start
+static uint64_t capture_tail_start(capture_t *c, int lines) {
+    static char buf[CAPTURE_IO_SIZE];
+    uint64_t off = c->tail;
+    
+    if (lines <= 0) return off;
+    
+    // A trailing newline ends the last line rather than starting another
+    if (off > c->head && c->ring[(off - 1) & (c->cap - 1)] == '\n') off--;
+    for (; off > c->head; off--) {
+        if (c->ring[(off - 1) & (c->cap - 1)] == '\n' && --lines == 0) return off;
+    }
+    if (c->head > c->spilled) return c->head;
+    
+    while (off > 0) {
+        size_t n = off < sizeof(buf) ? off : sizeof(buf);
+        if (pread(c->spill_fd, buf, n, off - n) != (ssize_t)n) break;
+        for (size_t i = n; i > 0; i--) {
+            if (buf[i - 1] == '\n' && --lines == 0) return off - n + i;
+        }
+        off -= n;
+    }
+    return 0;
+}
+
+// Pipe a job's output into a new capture; the child gets the write end
+static int open_capture(job_t *job, int *child_fd) {
+    job_info_t *info = job_info(job);
+    capture_t *c = capture_new(job->job_id, capture_size);
+    int fds[2];
+    
+    if (c == NULL) return -1;
+    if (open_pipe(fds) < 0) {
+        perror("pipe");
+        capture_free(c);
+        return -1;
+    }
+    
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u64 = EV_CAPTURE | EV_JOB(job->job_id, 0);
+    c->fd = fds[0];
+    if (fcntl(c->fd, F_SETFL, O_NONBLOCK) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("capture");
+        close(fds[1]);
+        capture_free(c);
+        return -1;
+    }
+    info->capture = c;
+    *child_fd = fds[1];
+    return 0;
+}
+
+// A job's capture pipe has data or hit EOF
+void capture_ready(int job_id) {
+    job_t *job = find_job_by_id(job_id);
+    if (job != NULL && job_info(job)->capture != NULL) {
+        capture_read(job_info(job)->capture);
+    }
+}
+
+// Open a job's -o file. The child gets the file itself, or with
+// --pipe-size the write end of a pipe the shell splices into the file,
+// so a stalling disk does not stall the job until the pipe fills.
+static int open_output(job_t *job, int *child_fd) {
+    job_output_t *out = job_info(job)->output;
+    int fd = open(out->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        perror(out->path);
+        return -1;
+    }
+    
+    // Reserve the blocks without changing the file size; only a hint
+    if (out->prealloc > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, out->prealloc) < 0 &&
+        errno != EOPNOTSUPP) {
+        perror("fallocate");
+    }
+    if (out->pipe_size == 0) {
+        *child_fd = fd;
+        return 0;
+    }
+    
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        close(fd);
+        return -1;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, out->pipe_size);
+    out->relay.in = fds[0];
+    out->relay.out = fd;
+    if (relay_watch(&out->relay, EV_RELAY | EV_JOB(job->job_id, RELAY_OUTPUT)) < 0) {
+        perror("relay");
+        relay_close(&out->relay);
+        close(fds[1]);
+        return -1;
+    }
+    *child_fd = fds[1];
+    return 0;
+}
+
+// Where a background job's stdout and stderr go: its -o file, a capture,
+// or (-1) the terminal
+static int open_job_output(job_t *job, int *child_fd) {
+    *child_fd = -1;
+    if (job_info(job)->output != NULL) return open_output(job, child_fd);
+    if (capture_size > 0) return open_capture(job, child_fd);
+    return 0;
+}
+
+// Parse a sysfs CPU or node list such as "0-3,8-11" into set
+static int parse_cpulist(const char *str, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*str != '\0' && *str != '\n') {
+        char *end;
+        long lo = strtol(str, &end, 10);
+        long hi = lo;
+        if (end == str) return -1;
+        if (*end == '-') {
+            str = end + 1;
+            hi = strtol(str, &end, 10);
+            if (end == str) return -1;
+        }
+        for (long i = lo; i <= hi && i < CPU_SETSIZE; i++) {
+            CPU_SET(i, set);
+        }
+        str = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+static int read_cpulist(const char *path, cpu_set_t *set) {
+    char buf[4096];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    int rc = fgets(buf, sizeof(buf), f) != NULL ? parse_cpulist(buf, set) : -1;
+    fclose(f);
+    return rc;
+}
+
+// Read the node topology from sysfs, keeping only the CPUs the shell may
+// run on. Without NUMA support it is one node of every CPU and no memory
+// policy. Returns -1 after reporting an error.
+int numa_load() {
+    cpu_set_t online, memory;
+    char path[64];
+    
+    if (numa_nodes != NULL) return 0;
+    
+    sched_getaffinity(0, sizeof(shell_cpus), &shell_cpus);
+    if (syscall(SYS_get_mempolicy, &shell_mempolicy, shell_nodemask,
+                NUMA_MAX_NODES, NULL, 0) < 0) {
+        shell_mempolicy = MPOL_DEFAULT;
+    }
+    
+    int has_numa = read_cpulist("/sys/devices/system/node/online", &online) == 0;
+    if (!has_numa) {
+        CPU_ZERO(&online);
+        CPU_SET(0, &online);
+    }
+    if (read_cpulist("/sys/devices/system/node/has_memory", &memory) < 0) {
+        CPU_ZERO(&memory);
+    }
+    
+    numa_nodes = calloc(CPU_COUNT(&online), sizeof(numa_node_t));
+    if (numa_nodes == NULL) {
+        printf("numa: out of memory\n");
+        return -1;
+    }
+    for (int id = 0; id < NUMA_MAX_NODES && id < CPU_SETSIZE; id++) {
+        if (!CPU_ISSET(id, &online)) continue;
+        numa_node_t *node = &numa_nodes[numa_count];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        if (read_cpulist(has_numa ? path : "/sys/devices/system/cpu/online", &node->cpus) < 0) {
+            continue;
+        }
+        CPU_AND(&node->cpus, &node->cpus, &shell_cpus);
+        if (CPU_COUNT(&node->cpus) == 0) continue;     // Memory-only, or not ours
+        node->id = id;
+        node->has_memory = has_numa && CPU_ISSET(id, &memory);
+        numa_count++;
+    }
+    if (numa_count == 0) {
+        printf("numa: no usable CPUs found in /sys/devices/system\n");
+        free(numa_nodes);
+        numa_nodes = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// numa_nodes index of a node id, -1 if it has no usable CPUs
+int numa_index(int node_id) {
+    for (int i = 0; i < numa_count; i++) {
+        if (numa_nodes[i].id == node_id) return i;
+    }
+    return -1;
+}
+
+// Pick the job's node as it launches: the one it asked for, else the one
+// with the fewest running jobs. NULL if it is not placed.
+static const numa_node_t* numa_place(job_info_t *info) {
+    int best = info->node_req;
+    if (best < 0) {
+        if (!numa_enabled || numa_load() < 0) return NULL;
+        best = 0;
+        for (int i = 1; i < numa_count; i++) {
+            if (numa_nodes[i].jobs < numa_nodes[best].jobs) best = i;
+        }
+    }
+    info->node = best;
+    numa_nodes[best].jobs++;
+    return &numa_nodes[best];
+}
+
+static void numa_release(job_info_t *info) {
+    if (info->node >= 0) numa_nodes[info->node].jobs--;
+    info->node = -1;
+}
+
+// set_mempolicy(MPOL_PREFERRED) for one node; there is no libc wrapper
+static void numa_prefer(int node_id) {
+    unsigned long mask[NUMA_MASK_LONGS] = { 0 };
+    mask[node_id / (8 * sizeof(unsigned long))] |= 1UL << (node_id % (8 * sizeof(unsigned long)));
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1);
+}
+
+// Apply a placement to the calling thread
+static void numa_apply(const numa_node_t *node) {
+    sched_setaffinity(0, sizeof(node->cpus), &node->cpus);
+    if (node->has_memory) numa_prefer(node->id);
+}
+
+// What a scheduling class means for a job: normal is SCHED_OTHER with
+// I/O priority following nice, batch is SCHED_BATCH at the lowest
+// best-effort I/O level, idle is SCHED_IDLE with idle I/O
+void sched_class(int policy, job_sched_t *s) {
+    memset(s, 0, sizeof(*s));
+    s->set = JOB_SCHED_POLICY | JOB_SCHED_IOPRIO;
+    s->policy = policy;
+    s->ioprio = policy == SCHED_IDLE ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+              : policy == SCHED_BATCH ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)
+              : IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+}
+
+// Apply s to one thread (0 = the caller). Safe in a vfork child; returns
+// -1 with errno set from the first step that failed.
+static int sched_apply(pid_t tid, const job_sched_t *s) {
+    int rc = 0;
+    int err = 0;
+    
+    if (s->set & JOB_SCHED_POLICY) {
+        struct sched_param param = { .sched_priority = 0 };
+        if (sched_setscheduler(tid, s->policy, &param) < 0) {
+            rc = -1;
+            err = errno;
+        }
+    }
+    if ((s->set & JOB_SCHED_NICE) && setpriority(PRIO_PROCESS, tid, s->nice) < 0 && rc == 0) {
+        rc = -1;
+        err = errno;
+    }
+    if ((s->set & JOB_SCHED_IOPRIO) &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, s->ioprio) < 0 && rc == 0) {
+        rc = -1;
+        err = errno;
+    }
+    errno = err;
+    return rc;
+}
+
+// Apply s to every thread of a running process. Processes it has already
+// started keep their own settings; new ones inherit.
+static int sched_apply_process(pid_t pid, const job_sched_t *s) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return sched_apply(pid, s);
+    }
+    
+    int rc = 0;
+    int err = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        pid_t tid = atoi(ent->d_name);
+        if (tid > 0 && sched_apply(tid, s) < 0 && rc == 0) {
+            rc = -1;
+            err = errno;
+        }
+    }
+    closedir(dir);
+    errno = err;
+    return rc;
+}
+
+// Change a job's scheduling: every process, every thread, or when it
+// launches if it has not yet. A nice value s leaves out is kept. Returns
+// -1 with errno set.
+int sched_job(job_t *job, const job_sched_t *s) {
+    job_info_t *info = job_info(job);
+    int rc = 0;
+    int err = 0;
+    
+    job_sched_t old = info->sched;
+    info->sched = *s;
+    if (!(s->set & JOB_SCHED_NICE) && (old.set & JOB_SCHED_NICE)) {
+        info->sched.set |= JOB_SCHED_NICE;
+        info->sched.nice = old.nice;
+    }
+    if (job->pid <= 0) return 0;
+    
+    pipeline_t *pl = info->pipeline;
+    for (int i = 0; i < (pl ? pl->nstages : 1); i++) {
+        if (pl && pl->stages[i].pidfd < 0) continue;
+        if (sched_apply_process(pl ? pl->stages[i].pid : job->pid, s) < 0 && rc == 0) {
+            rc = -1;
+            err = errno;
+        }
+    }
+    errno = err;
+    return rc;
+}
+
+// Start a QUEUED job's process, or all of its pipeline, in its own
+// process group. On failure the job is deleted.
+int launch_job(job_t *job) {
+    job_info_t *info = job_info(job);
+    char *argv[MAX_ARGS];
+    char *p = info->argv;
+    
+    for (int i = 0; i < info->argc; i++) {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[info->argc] = NULL;
+    
+    numa_place(info);
+    if (count_stages(argv) > 1) {
+        if (launch_pipeline(job, argv, 1) < 0) {
+            delete_job(job);
+            return -1;
+        }
+        job_timer_start(job);
+        return 0;
+    }
+    
+    // Create new process group for background jobs
+    spawn_req_t req = { .argv = argv, .new_pgrp = 1, .fds = { -1, -1, -1 } };
+    int out_fd;
+    if (open_job_output(job, &out_fd) < 0) {
+        delete_job(job);
+        return -1;
+    }
+    req.fds[1] = req.fds[2] = out_fd;
+    req.cgroup = info->cgroup;
+    req.node = info->node >= 0 ? &numa_nodes[info->node] : NULL;
+    req.sched = info->sched.set ? &info->sched : NULL;
+    
+    pid_t pid;
+    int pidfd;
+    int rc = start_child(&req, 0, &pid, &pidfd);
+    if (out_fd >= 0) close(out_fd);
+    if (rc < 0) {
+        delete_job(job);
+        return -1;
+    }
+    
+    set_job_pid(job, pid, pidfd);
+    perf_attach(pid, &job_info(job)->perf);
+    job->state = RUNNING;
+    job_timer_start(job);
+    return 0;
+}
+
+// Close a pipeline's remaining fds; processes still running are left alone
+static void free_pipeline(pipeline_t *pl) {
+    if (pl == NULL) return;
+    for (int i = 0; i < pl->nstages; i++) {
+        if (pl->stages[i].pidfd >= 0) close(pl->stages[i].pidfd);
+        perf_close(&pl->stages[i].perf);
+    }
+    if (pl->relays) {
+        for (int i = 0; i < pl->nstages - 1; i++) {
+            relay_close(&pl->relays[i]);
+        }
+    }
+    free(pl->relays);
+    free(pl);
+}
+
+// Flush what a job's output pipe still holds into the file, then close
+static void free_output(job_output_t *out) {
+    if (out == NULL) return;
+    relay_move(&out->relay);
+    relay_close(&out->relay);
+    free(out);
+}
+
+// Find and open the delegated cgroup subtree: the one 'set cgroup' gave,
+// else the shell's own cgroup under the cgroup2 mount
+static int cgroup_root_open() {
+    if (cgroup_root_fd >= 0) return 0;
+    
+    if (cgroup_root[0] == '\0') {
+        char line[PATH_MAX + 256];
+        char mount[PATH_MAX] = "";
+        char path[sizeof(line)] = "";   // Checked against cgroup_root below
+        FILE *f = fopen("/proc/self/mountinfo", "r");
+        while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+            if (strstr(line, " - cgroup2 ") != NULL &&
+                sscanf(line, "%*s %*s %*s %*s %4095s", mount) == 1) {
+                break;
+            }
+            mount[0] = '\0';
+        }
+        if (f != NULL) fclose(f);
+        f = fopen("/proc/self/cgroup", "r");
+        while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(path, sizeof(path), "%s", strcmp(line + 3, "/") ? line + 3 : "");
+                break;
+            }
+        }
+        if (f != NULL) fclose(f);
+        if (mount[0] == '\0') {
+            printf("cgroup: no cgroup v2 hierarchy is mounted\n");
+            return -1;
+        }
+        if (strlen(mount) + strlen(path) >= sizeof(cgroup_root)) {
+            printf("cgroup: path too long\n");
+            return -1;
+        }
+        strcat(strcpy(cgroup_root, mount), path);
+    }
+    
+    cgroup_root_fd = open(cgroup_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cgroup_root_fd < 0) {
+        printf("cgroup: %s: %s\n", cgroup_root, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int cgroup_write(int dir_fd, const char *file, const char *value) {
+    int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, value, strlen(value));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return n < 0 ? -1 : 0;
+}
+
+// Read "key value" lines of a cgroup file; value of key, or 0
+static long long cgroup_read_key(int dir_fd, const char *file, const char *key) {
+    char buf[1024];
+    long long value = 0;
+    int fd = openat(dir_fd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    
+    size_t len = strlen(key);
+    for (char *line = buf; line != NULL && *line != '\0'; line = strchr(line, '\n')) {
+        if (*line == '\n') line++;
+        if (key[0] == '\0' || (strncmp(line, key, len) == 0 && line[len] == ' ')) {
+            value = strtoll(line + len, NULL, 10);
+            break;
+        }
+    }
+    return value;
+}
+
+// Let job cgroups use a controller. cgroup v2 only delegates controllers
+// from a cgroup with no processes in it, so the first time the shell (and
+// its zygote) move down into a "shell" leaf of their own.
+static int cgroup_enable(const char *controller) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "+%s", controller);
+    if (cgroup_write(cgroup_root_fd, "cgroup.subtree_control", buf) == 0) {
+        return 0;
+    }
+    
+    if (errno == EBUSY && (mkdirat(cgroup_root_fd, "shell", 0755) == 0 || errno == EEXIST)) {
+        int leaf = openat(cgroup_root_fd, "shell", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (leaf >= 0) {
+            char pid[16];
+            snprintf(pid, sizeof(pid), "%d", getpid());
+            cgroup_write(leaf, "cgroup.procs", pid);
+            if (zygote_pid > 0) {
+                snprintf(pid, sizeof(pid), "%d", zygote_pid);
+                cgroup_write(leaf, "cgroup.procs", pid);
+            }
+            close(leaf);
+        }
+        if (cgroup_write(cgroup_root_fd, "cgroup.subtree_control", buf) == 0) {
+            return 0;
+        }
+    }
+    
+    if (errno == ENOENT) {
+        printf("cgroup: the %s controller is not available in %s\n", controller, cgroup_root);
+    } else if (errno == EBUSY) {
+        printf("cgroup: %s has other processes in it; 'set cgroup' to a delegated subtree\n",
+               cgroup_root);
+    } else {
+        printf("cgroup: enabling %s in %s: %s\n", controller, cgroup_root, strerror(errno));
+    }
+    return -1;
+}
+
+// The cgroup for a job submitted with cgroup options: its own job-<id>, or
+// the named group, made on first use. Limits given are (re)applied.
+// Reports errors itself.
+job_cgroup_t* cgroup_get(int job_id, const job_opts_t *opts) {
+    static const struct {
+        const char *controller;
+        const char *file;
+    } limits[CG_LIMITS] = {
+        [CG_CPU_MAX] = { "cpu", "cpu.max" },
+        [CG_MEM_MAX] = { "memory", "memory.max" },
+        [CG_IO_WEIGHT] = { "io", "io.weight" },
+    };
+    char name[80];
+    job_cgroup_t *cg = NULL;
+    
+    if (cgroup_root_open() < 0) {
+        return NULL;
+    }
+    if (opts->cgroup != NULL) {
+        snprintf(name, sizeof(name), "group-%s", opts->cgroup);
+        for (cg = cgroup_groups; cg != NULL && strcmp(cg->name, name) != 0; cg = cg->next) {}
+    } else {
+        snprintf(name, sizeof(name), "job-%d", job_id);
+    }
+    
+    if (cg == NULL) {
+        cg = calloc(1, sizeof(*cg) + strlen(name) + 1);
+        if (cg == NULL) {
+            printf("Job table: out of memory\n");
+            return NULL;
+        }
+        strcpy(cg->name, name);
+        cg->named = opts->cgroup != NULL;
+        if (mkdirat(cgroup_root_fd, name, 0755) < 0 && errno != EEXIST) {
+            printf("cgroup: %s/%s: %s\n", cgroup_root, name, strerror(errno));
+            free(cg);
+            return NULL;
+        }
+        cg->fd = openat(cgroup_root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cg->fd < 0) {
+            printf("cgroup: %s/%s: %s\n", cgroup_root, name, strerror(errno));
+            unlinkat(cgroup_root_fd, name, AT_REMOVEDIR);
+            free(cg);
+            return NULL;
+        }
+        if (cg->named) {
+            cg->next = cgroup_groups;
+            cgroup_groups = cg;
+        }
+    }
+    cg->refs++;
+    
+    for (int i = 0; i < CG_LIMITS; i++) {
+        if (opts->limits[i][0] == '\0') continue;
+        if (cgroup_enable(limits[i].controller) < 0) {
+            cgroup_put(cg, NULL);
+            return NULL;
+        }
+        if (cgroup_write(cg->fd, limits[i].file, opts->limits[i]) < 0) {
+            printf("cgroup: %s: %s\n", limits[i].file, strerror(errno));
+            cgroup_put(cg, NULL);
+            return NULL;
+        }
+    }
+    return cg;
+}
+
+// Memory peak, CPU throttling and OOM kills of a job's own cgroup so far
+static void cgroup_usage(const job_cgroup_t *cg, job_usage_t *u) {
+    u->cg_peak_kb = cgroup_read_key(cg->fd, "memory.peak", "") / 1024;
+    u->cg_throttled_us = cgroup_read_key(cg->fd, "cpu.stat", "throttled_usec");
+    u->cg_oom_kills = cgroup_read_key(cg->fd, "memory.events", "oom_kill");
+}
+
+// A job is done with its cgroup. A job's own one has its final figures
+// read into usage (unless NULL) and is removed, as is a named group once
+// its last job is done.
+void cgroup_put(job_cgroup_t *cg, job_usage_t *usage) {
+    if (cg == NULL) return;
+    if (!cg->named && usage != NULL) {
+        cgroup_usage(cg, usage);
+    }
+    if (--cg->refs > 0) return;
+    
+    if (cg->named) {
+        job_cgroup_t **link = &cgroup_groups;
+        while (*link != cg) link = &(*link)->next;
+        *link = cg->next;
+    }
+    close(cg->fd);
+    // Fails if something the job left behind still runs in it
+    unlinkat(cgroup_root_fd, cg->name, AT_REMOVEDIR);
+    free(cg);
+}
+
+// Start every stage of a pipeline job, each one's stdout feeding the
+// next one's stdin. argv holds the stages separated by "|" tokens and is
+// split in place. All stages share stage 0's process group if new_pgrp
+// is set. On failure the stages already started are killed.
+int launch_pipeline(job_t *job, char **argv, int new_pgrp) {
+    int nstages = count_stages(argv);
+    pipeline_t *pl = calloc(1, sizeof(*pl) + nstages * sizeof(stage_t));
+    if (pl != NULL && pipe_relay) {
+        pl->relays = malloc((nstages - 1) * sizeof(relay_t));
+        if (pl->relays == NULL) {
+            free(pl);
+            pl = NULL;
+        }
+    }
+    if (pl == NULL) {
+        printf("Job table: out of memory\n");
+        return -1;
+    }
+    pl->nstages = nstages;
+    
+    // -o or capture: stderr of every stage and stdout of the last. Not
+    // for foreground pipelines, which keep the terminal.
+    int out_fd = -1;
+    job_info_t *info = job_info(job);
+    if (new_pgrp && open_job_output(job, &out_fd) < 0) {
+        free(pl->relays);
+        free(pl);
+        return -1;
+    }
+    
+    for (int i = 0; i < nstages; i++) {
+        pl->stages[i].pidfd = -1;
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            pl->stages[i].perf.fd[c] = -1;
+        }
+        if (pl->relays && i < nstages - 1) {
+            pl->relays[i].in = pl->relays[i].out = -1;
+        }
+    }
+    
+    int in = -1;                // Read end for the next stage's stdin
+    char **stage = argv;
+    for (int i = 0; i < nstages; i++) {
+        char **next = stage;
+        while (*next != NULL && strcmp(*next, "|") != 0) {
+            next++;
+        }
+        int last = (*next == NULL);
+        *next = NULL;
+        
+        // With the relay each link is two pipes with the shell in between
+        int out[2] = { -1, -1 };
+        int link[2] = { -1, -1 };
+        if (!last && (open_pipe(out) < 0 || (pl->relays && open_pipe(link) < 0))) {
+            perror("pipe");
+            if (out[0] >= 0) {
+                close(out[0]);
+                close(out[1]);
+            }
+            if (in >= 0) close(in);
+            goto fail;
+        }
+        
+        spawn_req_t req = { .argv = stage, .new_pgrp = new_pgrp, .cgroup = info->cgroup,
+                            .node = info->node >= 0 ? &numa_nodes[info->node] : NULL,
+                            .sched = info->sched.set ? &info->sched : NULL,
+                            .pgid = i > 0 ? pl->stages[0].pid : 0,
+                            .fds = { in, last ? out_fd : out[1], out_fd } };
+        int rc = start_child(&req, EV_STAGE | EV_JOB(job->job_id, i),
+                             &pl->stages[i].pid, &pl->stages[i].pidfd);
+        
+        // The child has its own copies now
+        if (in >= 0) close(in);
+        if (out[1] >= 0) close(out[1]);
+        in = out[0];
+        if (pl->relays && !last) {
+            pl->relays[i].in = out[0];
+            pl->relays[i].out = link[1];
+            in = link[0];
+        }
+        if (rc < 0) {
+            pl->stages[i].pidfd = -1;
+            if (in >= 0) close(in);
+            goto fail;
+        }
+        pl->live++;
+        perf_attach(pl->stages[i].pid, &pl->stages[i].perf);
+        
+        if (pl->relays && !last && relay_watch(&pl->relays[i], EV_RELAY | EV_JOB(job->job_id, i)) < 0) {
+            perror("relay");
+            close(in);
+            goto fail;
+        }
+        stage = next + 1;
+    }
+    
+    if (out_fd >= 0) close(out_fd);
+    info->pipeline = pl;
+    set_job_pid(job, pl->stages[0].pid, -1);
+    job->state = RUNNING;
+    return 0;
+    
+fail:
+    if (out_fd >= 0) close(out_fd);
+    for (int i = 0; i < nstages; i++) {
+        if (pl->stages[i].pidfd >= 0) {
+            discard_child(pl->stages[i].pidfd);
+            pl->stages[i].pidfd = -1;
+        }
+    }
+    free_pipeline(pl);
+    return -1;
+}
+
+// A relay pipe became ready
+void relay_pipe(int job_id, int link) {
+    job_t *job = find_job_by_id(job_id);
+    if (job == NULL) return;
+    
+    job_info_t *info = job_info(job);
+    if (link == RELAY_OUTPUT) {
+        if (info->output != NULL) relay_move(&info->output->relay);
+    } else if (info->pipeline != NULL && info->pipeline->relays != NULL &&
+               link < info->pipeline->nstages - 1) {
+        relay_move(&info->pipeline->relays[link]);
+    }
+}
+
+// Send sig to every live process of a job
+void signal_job(job_t *job, int sig) {
+    pipeline_t *pl = job_info(job)->pipeline;
+    
+    if (pl == NULL) {
+        pidfd_send_signal(job->pidfd, sig, NULL, 0);
+        return;
+    }
+    for (int i = 0; i < pl->nstages; i++) {
+        if (pl->stages[i].pidfd >= 0) {
+            pidfd_send_signal(pl->stages[i].pidfd, sig, NULL, 0);
+        }
+    }
+}
+
+// Runs in the child between fork/clone and exec. Sticks to plain system
+// calls: under the vfork backend the child shares the shell's memory.
+void child_setup(spawn_req_t *req) {
+    // Unblock the signals the shell reads through signalfd
+    sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+    setrlimit(RLIMIT_NOFILE, &child_nofile);
+    
+    if (req->new_pgrp) {
+        setpgid(0, req->pgid);
+    }
+    if (req->node != NULL) {
+        numa_apply(req->node);
+    }
+    if (req->sched != NULL) {
+        sched_apply(0, req->sched);
+    }
+    
+    for (int fd = 0; fd < 3; fd++) {
+        if (req->fds[fd] >= 0 && req->fds[fd] != fd) {
+            dup2(req->fds[fd], fd);
+        }
+    }
+}
+
+static pid_t spawn_fork(spawn_req_t *req) {
+    // Close-on-exec pipe back from the child: EOF once it has exec'd, or
+    // its errno if the exec failed
+    int status[2];
+    if (pipe2(status, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    pid_t pid;
+    if (req->cgroup != NULL) {
+        // Only clone3 can start a child straight in another cgroup; with
+        // no CLONE_VM it is a fork
+        struct clone_args args = { .flags = CLONE_INTO_CGROUP, .exit_signal = SIGCHLD,
+                                   .cgroup = req->cgroup->fd };
+        pid = syscall(SYS_clone3, &args, sizeof(args));
+    } else {
+        pid = fork();
+    }
+    
+    if (pid > 0 && req->new_pgrp) {
+        // From this side as well, so the next pipeline stage can join the
+        // group whether or not the child got to it first
+        setpgid(pid, req->pgid);
+    }
+    if (pid == 0) {
+        // Child process
+        close(status[0]);
+        child_setup(req);
+        if (req->path) {
+            execv(req->path, req->argv);
+        } else {
+            execvp(req->argv[0], req->argv);
+        }
+        int err = errno;
+        if (write(status[1], &err, sizeof(err)) < 0) {}
+        _exit(127);
+    }
+    
+    int err = errno;
+    close(status[1]);
+    if (pid > 0) {
+        ssize_t n;
+        while ((n = read(status[0], &err, sizeof(err))) < 0 && errno == EINTR) {}
+        if (n == sizeof(err)) {
+            // Exec failed and the child is exiting; reap it here
+            waitpid(pid, NULL, 0);
+            pid = -1;
+        }
+    }
+    close(status[0]);
+    errno = err;
+    return pid;
+}
+
+// The parent is suspended until the child execs or exits, so one static
+// stack serves every vfork child
+static char vfork_stack[64 * 1024] __attribute__((aligned(16)));
+
+static int vfork_child(void *arg) {
+    spawn_req_t *req = arg;
+    
+    child_setup(req);
+    if (req->path) {
+        execve(req->path, req->argv, req->envp ? req->envp : environ);
+    } else {
+        execvp(req->argv[0], req->argv);
+    }
+    req->exec_errno = errno;
+    _exit(127);
+}
+
+static pid_t spawn_vfork(spawn_req_t *req) {
+    req->exec_errno = 0;
+    pid_t pid = clone(vfork_child, vfork_stack + sizeof(vfork_stack),
+                      CLONE_VM | CLONE_VFORK | SIGCHLD, req);
+    
+    if (pid > 0 && req->exec_errno != 0) {
+        // Exec failed and the child has already exited; reap it here
+        waitpid(pid, NULL, 0);
+        errno = req->exec_errno;
+        return -1;
+    }
+    return pid;
+}
+
+static pid_t spawn_posix(spawn_req_t *req) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t defaults;
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    pid_t pid;
+    
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
+    
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setsigmask(&attr, &child_sigmask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (req->new_pgrp) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, req->pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    
+    for (int fd = 0; fd < 3; fd++) {
+        if (req->fds[fd] >= 0 && req->fds[fd] != fd) {
+            posix_spawn_file_actions_adddup2(&actions, req->fds[fd], fd);
+        }
+    }
+    
+    // posix_spawn has no rlimit attribute: the child inherits the fd limit
+    // in force during the call, so drop to the original one around it
+    int swap_limit = shell_nofile.rlim_cur != child_nofile.rlim_cur;
+    if (swap_limit) setrlimit(RLIMIT_NOFILE, &child_nofile);
+    // Nor placement attributes; CPU affinity and memory policy are
+    // inherited the same way
+    if (req->node != NULL) numa_apply(req->node);
+    int err = req->path
+        ? posix_spawn(&pid, req->path, &actions, &attr, req->argv, environ)
+        : posix_spawnp(&pid, req->argv[0], &actions, &attr, req->argv, environ);
+    if (swap_limit) setrlimit(RLIMIT_NOFILE, &shell_nofile);
+    if (req->node != NULL) {
+        sched_setaffinity(0, sizeof(shell_cpus), &shell_cpus);
+        syscall(SYS_set_mempolicy, shell_mempolicy, shell_nodemask, NUMA_MAX_NODES + 1);
+    }
+    
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Zygote side: receive requests, spawn with CLONE_PARENT so every job is
+// the shell's own child (reaped and pidfd-tracked like any other), and
+// reply with the pid. Never returns.
+static void zygote_main(int sock) {
+    static char buf[ZYGOTE_MSG_MAX];
+    static char *argv[MAX_ARGS];
+    static char *envp[ZYGOTE_MAX_ENV + 1];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    
+    // Die with the shell
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() == 1) _exit(0);
+    
+    for (;;) {
+        struct iovec iov = { buf, sizeof(buf) - 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                              .msg_control = control, .msg_controllen = sizeof(control) };
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            _exit(0);
+        }
+        
+        int fds[3];
+        int nfds = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+        
+        zygote_req_t hdr;
+        zygote_reply_t reply = { -1, EINVAL };
+        memcpy(&hdr, buf, sizeof(hdr));
+        buf[n] = '\0';
+        
+        if ((size_t)n > sizeof(hdr) && hdr.argc > 0 && hdr.argc < MAX_ARGS &&
+            hdr.envc <= ZYGOTE_MAX_ENV) {
+            // Unpack path, argv and env; they are consecutive strings
+            char *p = buf + sizeof(hdr);
+            char *end = buf + n;
+            spawn_req_t req = { .argv = argv, .envp = envp, .new_pgrp = hdr.new_pgrp,
+                                .pgid = hdr.pgid, .node = hdr.placed ? &hdr.node : NULL,
+                                .sched = hdr.sched.set ? &hdr.sched : NULL };
+            
+            req.path = p;
+            p += strlen(p) + 1;
+            for (uint32_t i = 0; i < hdr.argc && p < end; i++) {
+                argv[i] = p;
+                p += strlen(p) + 1;
+            }
+            argv[hdr.argc] = NULL;
+            for (uint32_t i = 0; i < hdr.envc && p < end; i++) {
+                envp[i] = p;
+                p += strlen(p) + 1;
+            }
+            envp[hdr.envc] = NULL;
+            for (int fd = 0; fd < 3; fd++) {
+                int idx = hdr.fd_map[fd];
+                req.fds[fd] = (idx >= 0 && idx < nfds) ? fds[idx] : -1;
+            }
+            
+            if (p <= end) {
+                reply.pid = clone(vfork_child, vfork_stack + sizeof(vfork_stack),
+                                  CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &req);
+                reply.err = reply.pid < 0 ? errno : req.exec_errno;
+            }
+        }
+        
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+}
+
+void start_zygote() {
+    int sv[2];
+    
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("zygote socketpair");
+        return;
+    }
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("zygote fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+    
+    close(sv[1]);
+    zygote_pid = pid;
+    zygote_sock = sv[0];
+}
+
+// Shell side: serialize the request, pass the stdio fds, wait for the pid
+static pid_t spawn_zygote(spawn_req_t *req) {
+    static char buf[ZYGOTE_MSG_MAX];
+    zygote_req_t hdr = { .new_pgrp = req->new_pgrp, .pgid = req->pgid,
+                         .placed = req->node != NULL };
+    if (req->node != NULL) {
+        hdr.node = *req->node;
+    }
+    if (req->sched != NULL) {
+        hdr.sched = *req->sched;
+    }
+    int fds[3];
+    int nfds = 0;
+    char **envp = req->envp ? req->envp : environ;
+    
+    if (zygote_sock < 0) {
+        errno = ECHILD;
+        return -1;
+    }
+    
+    // Strings: path, argv, env
+    size_t len = sizeof(hdr);
+    const char *path = req->path ? req->path : req->argv[0];
+    size_t n = strlen(path) + 1;
+    if (len + n > sizeof(buf)) goto too_big;
+    memcpy(buf + len, path, n);
+    len += n;
+    for (; req->argv[hdr.argc] != NULL; hdr.argc++) {
+        n = strlen(req->argv[hdr.argc]) + 1;
+        if (len + n > sizeof(buf)) goto too_big;
+        memcpy(buf + len, req->argv[hdr.argc], n);
+        len += n;
+    }
+    for (; envp[hdr.envc] != NULL && hdr.envc < ZYGOTE_MAX_ENV; hdr.envc++) {
+        n = strlen(envp[hdr.envc]) + 1;
+        if (len + n > sizeof(buf)) goto too_big;
+        memcpy(buf + len, envp[hdr.envc], n);
+        len += n;
+    }
+    
+    for (int fd = 0; fd < 3; fd++) {
+        hdr.fd_map[fd] = -1;
+        if (req->fds[fd] >= 0) {
+            hdr.fd_map[fd] = nfds;
+            fds[nfds++] = req->fds[fd];
+        }
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+    
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (nfds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    
+    zygote_reply_t reply;
+    if (sendmsg(zygote_sock, &msg, MSG_NOSIGNAL) < 0 ||
+        recv(zygote_sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        // The zygote is gone; fall back to posix_spawn from now on
+        perror("zygote");
+        close(zygote_sock);
+        zygote_sock = -1;
+        waitpid(zygote_pid, NULL, WNOHANG);
+        spawn_backend = SPAWN_POSIX;
+        return spawn_posix(req);
+    }
+    
+    if (reply.err != 0) {
+        // Exec failed: the child is ours and has already exited
+        if (reply.pid > 0) waitpid(reply.pid, NULL, 0);
+        errno = reply.err;
+        return -1;
+    }
+    return reply.pid;
+    
+too_big:
+    errno = E2BIG;
+    return -1;
+}
+
+// Start a child with the selected backend. Returns its pid, or -1 with
+// errno set (ENOENT for an unknown command)
+pid_t spawn_child(spawn_req_t *req) {
+    // The other backends have no way to pick the child's cgroup
+    if (req->cgroup != NULL) {
+        return spawn_fork(req);
+    }
+    // posix_spawn can set a policy but not nice or I/O priority
+    if (req->sched != NULL && spawn_backend == SPAWN_POSIX) {
+        return spawn_vfork(req);
+    }
+    switch (spawn_backend) {
+        case SPAWN_VFORK: return spawn_vfork(req);
+        case SPAWN_POSIX: return spawn_posix(req);
+        case SPAWN_ZYGOTE: return spawn_zygote(req);
+        default: return spawn_fork(req);
+    }
+}
+
+static job_t* job_at(int slot) {
+    return &job_chunks[slot >> JOB_CHUNK_BITS]->jobs[slot & JOB_CHUNK_MASK];
+}
+
+// Chunk availability list helpers
+static void avail_link(int c) {
+    job_chunks[c]->prev_avail = NO_SLOT;
+    job_chunks[c]->next_avail = avail_chunks;
+    if (avail_chunks != NO_SLOT) {
+        job_chunks[avail_chunks]->prev_avail = c;
+    }
+    avail_chunks = c;
+}
+
+static void avail_unlink(int c) {
+    job_chunk_t *chunk = job_chunks[c];
+    if (chunk->prev_avail != NO_SLOT) {
+        job_chunks[chunk->prev_avail]->next_avail = chunk->next_avail;
+    } else {
+        avail_chunks = chunk->next_avail;
+    }
+    if (chunk->next_avail != NO_SLOT) {
+        job_chunks[chunk->next_avail]->prev_avail = chunk->prev_avail;
+    }
+}
+
+// Allocate a new chunk, reusing a released chunk number if there is one
+static int chunk_alloc() {
+    int c;
+    for (c = 0; c < chunk_cap && job_chunks[c] != NULL; c++);
+    if (c == chunk_cap) {
+        int cap = chunk_cap ? chunk_cap * 2 : 4;
+        job_chunk_t **grown = realloc(job_chunks, cap * sizeof(*grown));
+        if (grown == NULL) return NO_SLOT;
+        memset(grown + chunk_cap, 0, (cap - chunk_cap) * sizeof(*grown));
+        job_chunks = grown;
+        chunk_cap = cap;
+    }
+    
+    job_chunk_t *chunk = malloc(sizeof(job_chunk_t));
+    if (chunk == NULL) return NO_SLOT;
+    
+    // Thread the free list through the slots in ascending order
+    for (int i = 0; i < JOB_CHUNK_SIZE; i++) {
+        chunk->jobs[i].job_id = 0;
+        chunk->jobs[i].next = i + 1 < JOB_CHUNK_SIZE ? i + 1 : NO_SLOT;
+    }
+    chunk->free_head = 0;
+    chunk->live = 0;
+    job_chunks[c] = chunk;
+    avail_link(c);
+    empty_chunks++;
+    return c;
+}
+
+static int slot_alloc() {
+    if (avail_chunks == NO_SLOT && chunk_alloc() == NO_SLOT) {
+        return NO_SLOT;
+    }
+    
+    int c = avail_chunks;
+    job_chunk_t *chunk = job_chunks[c];
+    int off = chunk->free_head;
+    chunk->free_head = chunk->jobs[off].next;
+    if (chunk->live++ == 0) empty_chunks--;
+    if (chunk->free_head == NO_SLOT) avail_unlink(c);
+    return (c << JOB_CHUNK_BITS) | off;
+}
+
+static void slot_free(int slot) {
+    int c = slot >> JOB_CHUNK_BITS;
+    job_chunk_t *chunk = job_chunks[c];
+    
+    if (chunk->free_head == NO_SLOT) avail_link(c);
+    chunk->jobs[slot & JOB_CHUNK_MASK].next = chunk->free_head;
+    chunk->free_head = slot & JOB_CHUNK_MASK;
+    
+    if (--chunk->live == 0) {
+        // Keep one empty chunk as a spare so a job count hovering at a
+        // chunk boundary does not malloc/free on every job
+        if (empty_chunks > 0) {
+            avail_unlink(c);
+            free(chunk);
+            job_chunks[c] = NULL;
+        } else {
+            empty_chunks++;
+        }
+    }
+}
+
+// Index helpers: buckets store slot numbers and read the key back from the
+// slot, so an entry is a single int
+static int index_key(job_index_t *index, int slot) {
+    return index == &pid_index ? job_at(slot)->pid : job_at(slot)->job_id;
+}
+
+static unsigned index_home(job_index_t *index, int key) {
+    // Fibonacci hashing spreads sequential pids and job ids across buckets
+    return ((unsigned)key * 2654435769u) >> (32 - index->bits);
+}
+
+static int index_lookup(job_index_t *index, int key) {
+    unsigned mask = (1u << index->bits) - 1;
+    for (unsigned i = index_home(index, key); index->buckets[i] != NO_SLOT;
+         i = (i + 1) & mask) {
+        if (index_key(index, index->buckets[i]) == key) {
+            return index->buckets[i];
+        }
+    }
+    return NO_SLOT;
+}
+
+static void index_insert(job_index_t *index, int slot) {
+    unsigned mask = (1u << index->bits) - 1;
+    unsigned i = index_home(index, index_key(index, slot));
+    while (index->buckets[i] != NO_SLOT) {
+        i = (i + 1) & mask;
+    }
+    index->buckets[i] = slot;
+}
+
+static void index_remove(job_index_t *index, int slot) {
+    unsigned mask = (1u << index->bits) - 1;
+    unsigned i = index_home(index, index_key(index, slot));
+    while (index->buckets[i] != slot) {
+        if (index->buckets[i] == NO_SLOT) return;
+        i = (i + 1) & mask;
+    }
+    
+    // Backward-shift deletion: pull later entries of the probe run into the
+    // hole so lookups never need tombstones
+    unsigned hole = i;
+    for (unsigned j = (hole + 1) & mask; index->buckets[j] != NO_SLOT;
+         j = (j + 1) & mask) {
+        unsigned home = index_home(index, index_key(index, index->buckets[j]));
+        // Move the entry unless its home lies cyclically in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            index->buckets[hole] = index->buckets[j];
+            hole = j;
+        }
+    }
+    index->buckets[hole] = NO_SLOT;
+}
+
+// Rebuild an index with 2^bits buckets from the live job list
+static int index_resize(job_index_t *index, unsigned bits) {
+    int *buckets = malloc(sizeof(int) << bits);
+    if (buckets == NULL) return -1;
+    
+    for (unsigned i = 0; i < (1u << bits); i++) {
+        buckets[i] = NO_SLOT;
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bits = bits;
+    for (int slot = job_head; slot != NO_SLOT; slot = job_at(slot)->next) {
+        // Jobs still queued have no pid yet
+        if (index_key(index, slot) != 0) {
+            index_insert(index, slot);
+        }
+    }
+    return 0;
+}
+
+void init_job_table() {
+    if (index_resize(&pid_index, JOB_INDEX_MIN_BITS) < 0 ||
+        index_resize(&id_index, JOB_INDEX_MIN_BITS) < 0) {
+        perror("job table");
+        exit(1);
+    }
+}
+
+static str_hdr_t* str_hdr(uint32_t off) {
+    return (str_hdr_t *)(arena.data + off);
+}
+
+static uint32_t str_hash(const char *str, uint32_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Bytes a string occupies in the arena: header, text, NUL, 4-byte aligned
+static uint32_t str_size(uint32_t len) {
+    return (ARENA_HDR_SIZE + len + 1 + 3) & ~3u;
+}
+
+static void intern_insert(uint32_t off) {
+    unsigned mask = (1u << arena.bits) - 1;
+    unsigned i = str_hdr(off)->hash & mask;
+    while (arena.buckets[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    arena.buckets[i] = off + 1;
+}
+
+static void intern_remove(uint32_t off) {
+    unsigned mask = (1u << arena.bits) - 1;
+    unsigned i = str_hdr(off)->hash & mask;
+    while (arena.buckets[i] != off + 1) {
+        if (arena.buckets[i] == 0) return;
+        i = (i + 1) & mask;
+    }
+    
+    // Same backward-shift deletion as the job indexes
+    unsigned hole = i;
+    for (unsigned j = (hole + 1) & mask; arena.buckets[j] != 0; j = (j + 1) & mask) {
+        unsigned home = str_hdr(arena.buckets[j] - 1)->hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            arena.buckets[hole] = arena.buckets[j];
+            hole = j;
+        }
+    }
+    arena.buckets[hole] = 0;
+}
+
+// Rebuild the intern table with 2^bits buckets by walking the arena
+static int intern_rebuild(unsigned bits) {
+    uint32_t *buckets = calloc(1u << bits, sizeof(uint32_t));
+    if (buckets == NULL) return -1;
+    
+    free(arena.buckets);
+    arena.buckets = buckets;
+    arena.bits = bits;
+    for (uint32_t off = 0; off < arena.used; off += str_size(str_hdr(off)->len)) {
+        if (str_hdr(off)->refs > 0) {
+            intern_insert(off);
+        }
+    }
+    return 0;
+}
+
+// Squeeze dead strings out of the arena and repoint every job
+static void arena_compact() {
+    uint32_t cap = ARENA_MIN_SIZE;
+    while (cap < (arena.used - arena.dead) * 2) cap *= 2;
+    char *data = malloc(cap);
+    if (data == NULL) return;
+    
+    uint32_t used = 0;
+    for (uint32_t off = 0; off < arena.used; off += str_size(str_hdr(off)->len)) {
+        str_hdr_t *hdr = str_hdr(off);
+        if (hdr->refs > 0) {
+            uint32_t size = str_size(hdr->len);
+            memcpy(data + used, hdr, size);
+            hdr->fwd = used;
+            used += size;
+        }
+    }
+    for (int slot = job_head; slot != NO_SLOT; slot = job_at(slot)->next) {
+        job_at(slot)->command = str_hdr(job_at(slot)->command)->fwd;
+    }
+    for (int i = 0; i < history_len; i++) {
+        history[i].command = str_hdr(history[i].command)->fwd;
+    }
+    if (fg_command != UINT32_MAX) {
+        fg_command = str_hdr(fg_command)->fwd;
+    }
+    
+    free(arena.data);
+    arena.data = data;
+    arena.used = used;
+    arena.cap = cap;
+    arena.dead = 0;
+    
+    unsigned bits = JOB_INDEX_MIN_BITS;
+    while ((1u << bits) < arena.count * 4) bits++;
+    intern_rebuild(bits);
+}
+
+// Return the arena offset of str, adding it if no live copy exists
+uint32_t str_intern(const char *str) {
+    uint32_t len = strlen(str);
+    uint32_t hash = str_hash(str, len);
+    
+    if (arena.buckets != NULL) {
+        unsigned mask = (1u << arena.bits) - 1;
+        for (unsigned i = hash & mask; arena.buckets[i] != 0; i = (i + 1) & mask) {
+            uint32_t off = arena.buckets[i] - 1;
+            str_hdr_t *hdr = str_hdr(off);
+            if (hdr->hash == hash && hdr->len == len &&
+                memcmp(arena.data + off + ARENA_HDR_SIZE, str, len) == 0) {
+                hdr->refs++;
+                return off;
+            }
+        }
+    }
+    
+    // Keep the intern table at most half full
+    if ((arena.count + 1) * 2 > (arena.buckets ? 1u << arena.bits : 0)) {
+        if (intern_rebuild(arena.buckets ? arena.bits + 1 : JOB_INDEX_MIN_BITS) < 0) {
+            return UINT32_MAX;
+        }
+    }
+    
+    uint32_t size = str_size(len);
+    if (arena.used + size > arena.cap) {
+        uint32_t cap = arena.cap ? arena.cap : ARENA_MIN_SIZE;
+        while (arena.used + size > cap) cap *= 2;
+        char *data = realloc(arena.data, cap);
+        if (data == NULL) return UINT32_MAX;
+        arena.data = data;
+        arena.cap = cap;
+    }
+    
+    uint32_t off = arena.used;
+    str_hdr_t *hdr = str_hdr(off);
+    hdr->refs = 1;
+    hdr->len = len;
+    hdr->hash = hash;
+    memcpy(arena.data + off + ARENA_HDR_SIZE, str, len + 1);
+    arena.used += size;
+    arena.count++;
+    intern_insert(off);
+    return off;
+}
+
+// Drop one reference; dead strings are reclaimed by compaction
+void str_release(uint32_t off) {
+    str_hdr_t *hdr = str_hdr(off);
+    if (--hdr->refs > 0) return;
+    
+    intern_remove(off);
+    arena.count--;
+    arena.dead += str_size(hdr->len);
+    if (arena.cap > ARENA_MIN_SIZE && arena.dead * 2 > arena.used) {
+        arena_compact();
+    }
+}
+
+const char* job_command(const job_t *job) {
+    return arena.data + job->command + ARENA_HDR_SIZE;
+}
+
+static void usage_add(job_usage_t *total, const job_usage_t *u) {
+    total->user_us += u->user_us;
+    total->sys_us += u->sys_us;
+    total->maxrss_kb += u->maxrss_kb;
+    total->minflt += u->minflt;
+    total->majflt += u->majflt;
+    total->nvcsw += u->nvcsw;
+    total->nivcsw += u->nivcsw;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        total->perf[i] += u->perf[i];
+    }
+    total->cg_peak_kb += u->cg_peak_kb;
+    total->cg_throttled_us += u->cg_throttled_us;
+    total->cg_oom_kills += u->cg_oom_kills;
+}
+
+// Record a completed job, overwriting the oldest once the ring is full.
+// Takes its own reference to the command string.
+void history_add(int job_id, uint32_t command, int status, int64_t started_ns,
+                 const job_usage_t *usage) {
+    int64_t wall_ns = now_ns() - started_ns;
+    
+    total_jobs++;
+    if (status != 0) total_failed++;
+    usage_add(&total_usage, usage);
+    total_wall_ns += wall_ns;
+    
+    if (history == NULL) {
+        history = malloc(JOB_HISTORY * sizeof(*history));
+        if (history == NULL) return;
+    }
+    job_record_t *rec = &history[history_next];
+    uint32_t evicted = history_len == JOB_HISTORY ? rec->command : UINT32_MAX;
+    if (history_len < JOB_HISTORY) history_len++;
+    history_next = (history_next + 1) % JOB_HISTORY;
+    
+    str_hdr(command)->refs++;
+    rec->job_id = job_id;
+    rec->command = command;
+    rec->status = status;
+    rec->started_ns = started_ns;
+    rec->wall_ns = wall_ns;
+    rec->usage = *usage;
+    
+    // Last: releasing may compact the arena, which repoints the records
+    if (evicted != UINT32_MAX) {
+        str_release(evicted);
+    }
+}
+
+// Enter a job into the table; job_id 0 takes the next job id
+job_t* add_job(int job_id, pid_t pid, int pidfd, const char *command, job_state_t state) {
+    // Keep the indexes at most half full; growing after the job is linked
+    // would rehash it twice, so grow first
+    if ((unsigned)(job_count + 1) * 2 > (1u << pid_index.bits)) {
+        if (index_resize(&pid_index, pid_index.bits + 1) < 0 ||
+            index_resize(&id_index, id_index.bits + 1) < 0) {
+            printf("Job table: out of memory\n");
+            return NULL;
+        }
+    }
+    
+    uint32_t cmd = str_intern(command);
+    int slot = cmd == UINT32_MAX ? NO_SLOT : slot_alloc();
+    if (slot == NO_SLOT) {
+        if (cmd != UINT32_MAX) str_release(cmd);
+        printf("Job table: out of memory\n");
+        return NULL;
+    }
+    
+    job_t *job = job_at(slot);
+    job->slot = slot;
+    job_info_t *info = job_info(job);
+    job->job_id = job_id ? job_id : next_job_id++;
+    job->pid = pid;
+    job->pidfd = pidfd;
+    job->state = state;
+    job->command = cmd;
+    job->started_ns = now_ns();
+    info->argv = NULL;
+    info->argc = 0;
+    info->priority = 0;
+    info->heap_pos = -1;
+    info->deps_left = 0;
+    info->dependents = NULL;
+    info->ndependents = 0;
+    info->dep_cap = 0;
+    info->status = -1;
+    memset(&info->usage, 0, sizeof(info->usage));
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        info->perf.fd[i] = -1;
+    }
+    info->pipeline = NULL;
+    info->output = NULL;
+    info->capture = NULL;
+    info->cgroup = NULL;
+    info->node_req = -1;
+    info->node = -1;
+    memset(&info->sched, 0, sizeof(info->sched));
+    info->auto_sched = 0;
+    info->timeout_ns = 0;
+    info->deadline_ns = 0;
+    info->timed_out = 0;
+    info->timer.next = NULL;
+    info->timer.pprev = NULL;
+    info->retry = NULL;
+    info->attempt = 1;
+    info->array = NULL;
+    info->array_id = 0;
+    info->array_index = 0;
+    
+    // Append to insertion order
+    job->prev = job_tail;
+    job->next = NO_SLOT;
+    if (job_tail != NO_SLOT) {
+        job_at(job_tail)->next = slot;
+    } else {
+        job_head = slot;
+    }
+    job_tail = slot;
+    
+    if (pid > 0) {
+        index_insert(&pid_index, slot);
+        active_jobs++;
+    }
+    index_insert(&id_index, slot);
+    job_count++;
+    return job;
+}
+
+// Attach a freshly launched process to a job that had none
+void set_job_pid(job_t *job, pid_t pid, int pidfd) {
+    job->pid = pid;
+    job->pidfd = pidfd;
+    job->started_ns = now_ns();
+    index_insert(&pid_index, job->slot);
+    active_jobs++;
+}
+
+// Make job wait for parent to finish (need_ok: and to exit 0)
+int add_dependency(job_t *parent, job_t *job, int need_ok) {
+    job_info_t *pinfo = job_info(parent);
+    if (pinfo->ndependents == pinfo->dep_cap) {
+        int cap = pinfo->dep_cap ? pinfo->dep_cap * 2 : 4;
+        dep_edge_t *grown = realloc(pinfo->dependents, cap * sizeof(*grown));
+        if (grown == NULL) return -1;
+        pinfo->dependents = grown;
+        pinfo->dep_cap = cap;
+    }
+    
+    dep_edge_t edge = { job->job_id, need_ok };
+    pinfo->dependents[pinfo->ndependents++] = edge;
+    job_info(job)->deps_left++;
+    return 0;
+}
+
+// A job left the table: count it off for each job waiting on it. Jobs
+// with nothing left to wait for join the run queue; a failed afterok
+// dependency cancels the dependent, which in turn releases its own.
+static void release_dependents(int job_id, dep_edge_t *deps, int n, int ok) {
+    int released = 0;
+    
+    for (int i = 0; i < n; i++) {
+        job_t *dep = find_job_by_id(deps[i].job_id);
+        if (dep == NULL || dep->state != WAITING) continue;  // Cancelled meanwhile
+        
+        if (deps[i].need_ok && !ok) {
+            printf("\n[%d] Cancelled, job [%d] failed: %s\n",
+                   dep->job_id, job_id, job_command(dep));
+            notify_pending = 1;
+            delete_job(dep);
+            continue;
+        }
+        if (--job_info(dep)->deps_left > 0) continue;
+        
+        dep->state = QUEUED;
+        if (enqueue_job(dep) < 0) {
+            printf("\n[%d] Job table: out of memory: %s\n", dep->job_id, job_command(dep));
+            notify_pending = 1;
+            delete_job(dep);
+            continue;
+        }
+        released = 1;
+    }
+    
+    if (released) {
+        dispatch_queued();
+    }
+}
+
+// Whether a failed attempt gets another one
+static int retry_wanted(const job_info_t *info) {
+    const job_retry_t *r = info->retry;
+    if (r == NULL || info->status == 0 || info->attempt > r->retries) return 0;
+    if (r->any_failure) return 1;
+    return info->status > 0 && info->status < 256 &&
+           (r->statuses[info->status / 32] & (1u << (info->status % 32)));
+}
+
+// Wind up a failed attempt the way delete_job would, but keep the job:
+// it waits in BACKOFF, then re-enters the queue with the same argv
+static void retry_job(job_t *job) {
+    job_info_t *info = job_info(job);
+    const job_retry_t *r = info->retry;
+    
+    // Exponential, capped; only half of it is certain, so jobs that
+    // failed together do not all come back at once
+    int64_t delay = r->base_ns;
+    for (int i = 1; i < info->attempt && delay < r->max_ns; i++) {
+        delay *= 2;
+    }
+    if (delay > r->max_ns) delay = r->max_ns;
+    delay = delay / 2 + (int64_t)((double)random() / RAND_MAX * (delay / 2));
+    
+    char wait[32];
+    format_duration(delay, wait, sizeof(wait));
+    printf("\n[%s] Failed (status %d), attempt %d of %d; retrying in %s: %s\n", job_name(job),
+           info->status, info->attempt, r->retries + 1, wait, job_command(job));
+    notify_pending = 1;
+    
+    history_add(info->array_id ? info->array_id : job->job_id, job->command, info->status, job->started_ns, &info->usage);
+    index_remove(&pid_index, job->slot);
+    active_jobs--;
+    perf_close(&info->perf);
+    numa_release(info);
+    free_pipeline(info->pipeline);
+    info->pipeline = NULL;
+    if (info->output != NULL) {
+        // Reopened, and truncated, by the next attempt
+        relay_move(&info->output->relay);
+        relay_close(&info->output->relay);
+    }
+    capture_retire(info->capture);
+    info->capture = NULL;
+    
+    job->pid = 0;
+    job->pidfd = -1;
+    job->state = BACKOFF;
+    info->status = -1;
+    memset(&info->usage, 0, sizeof(info->usage));
+    info->timed_out = 0;
+    info->attempt++;
+    
+    // A deadline before the delay is up cancels it instead
+    int64_t due = now_ns() + delay;
+    if (info->deadline_ns > 0 && info->deadline_ns < due) due = info->deadline_ns;
+    info->timer.job_id = job->job_id;
+    wheel_add(&info->timer, wheel_tick_ceil(due));
+}
+
+// All of a job's processes have been reaped: retry it or drop it
+static void finish_job(job_t *job, int foreground) {
+    if (retry_wanted(job_info(job))) {
+        retry_job(job);
+        return;
+    }
+    // A job that used up its retries, or an array element, is reported as
+    // failed; elements only speak up then, the array reports the rest
+    job_info_t *info = job_info(job);
+    if (!foreground && info->status != 0 && (info->retry != NULL || info->array_id != 0)) {
+        printf("\n[%s] Failed (status %d): %s\n", job_name(job), info->status, job_command(job));
+        notify_pending = 1;
+    } else if (!foreground && info->array_id == 0) {
+        printf("\n[%d] Done: %s\n", job->job_id, job_command(job));
+        notify_pending = 1;
+    }
+    delete_job(job);
+}
+
+void remove_job(pid_t pid) {
+    int slot = index_lookup(&pid_index, pid);
+    if (slot != NO_SLOT) {
+        delete_job(job_at(slot));
+    }
+}
+
+void delete_job(job_t *job) {
+    int slot = job->slot;
+    int job_id = job->job_id;
+    job_info_t *info = job_info(job);
+    dep_edge_t *dependents = info->dependents;
+    int ndependents = info->ndependents;
+    int ok = info->status == 0;
+    
+    if (control_waiters > 0) {
+        control_job_done(job);
+    }
+    
+    // Its processes are all reaped; last figures from its own cgroup
+    cgroup_put(info->cgroup, &info->usage);
+    
+    // Jobs that ran are remembered, elements under their array; cancelled
+    // ones never started
+    int array_id = info->array_id;
+    if (job->pid > 0) {
+        history_add(array_id ? array_id : job_id, job->command, info->status,
+                    job->started_ns, &info->usage);
+    }
+    job_t *array_job = array_id ? find_job_by_id(array_id) : NULL;
+    if (array_job != NULL) {
+        job_array_t *a = job_info(array_job)->array;
+        a->running--;
+        if (job->pid == 0) {
+            a->cancelled++;
+        } else if (ok) {
+            a->done++;
+        } else {
+            a->failed++;
+        }
+        usage_add(&job_info(array_job)->usage, &info->usage);
+    }
+    
+    if (job->state == QUEUED) {
+        dequeue_job(job);
+    }
+    if (job->pid > 0) {
+        index_remove(&pid_index, slot);
+        active_jobs--;
+    }
+    index_remove(&id_index, slot);
+    wheel_del(&info->timer);
+    free(info->retry);
+    if (info->array != NULL) {
+        free(info->array->taken);
+        reader_close(info->array->input);
+        free(info->array);
+    }
+    free(info->argv);
+    perf_close(&info->perf);
+    numa_release(info);
+    free_pipeline(info->pipeline);
+    free_output(info->output);
+    capture_retire(info->capture);
+    
+    // Unlink from insertion order
+    if (job->prev != NO_SLOT) {
+        job_at(job->prev)->next = job->next;
+    } else {
+        job_head = job->next;
+    }
+    if (job->next != NO_SLOT) {
+        job_at(job->next)->prev = job->prev;
+    } else {
+        job_tail = job->prev;
+    }
+    
+    str_release(job->command);
+    job->job_id = 0;
+    slot_free(slot);
+    job_count--;
+    
+    // Give memory back once the table has drained; a failed shrink just
+    // leaves the larger index in place
+    if (pid_index.bits > JOB_INDEX_MIN_BITS &&
+        (unsigned)job_count * 8 < (1u << pid_index.bits)) {
+        index_resize(&pid_index, pid_index.bits - 1);
+        index_resize(&id_index, id_index.bits - 1);
+    }
+    
+    // Last, with the table consistent: this may launch or cancel jobs
+    release_dependents(job_id, dependents, ndependents, ok);
+    free(dependents);
+    if (array_job != NULL) {
+        array_update(array_id);
+    }
+}
+
+job_info_t* job_info(const job_t *job) {
+    return &job_chunks[job->slot >> JOB_CHUNK_BITS]->info[job->slot & JOB_CHUNK_MASK];
+}
+
+// Copy src to dst with every "{}" replaced by the items (packed,
+// NUL-separated) joined by spaces; NULL if it does not fit in n bytes
+static char* expand_items(char *dst, size_t n, const char *src, const char *items, int nitems) {
+    size_t len = 0;
+    
+    while (*src) {
+        if (src[0] != '{' || src[1] != '}') {
+            if (len + 1 >= n) return NULL;
+            dst[len++] = *src++;
+            continue;
+        }
+        const char *item = items;
+        for (int i = 0; i < nitems; i++) {
+            size_t item_len = strlen(item);
+            if (len + item_len + 1 >= n) return NULL;
+            if (i > 0) dst[len++] = ' ';
+            memcpy(dst + len, item, item_len);
+            len += item_len;
+            item += item_len + 1;
+        }
+        src += 2;
+    }
+    dst[len] = '\0';
+    return dst;
+}
+
+// Point args[argc...] at each of the packed items; the new argc
+static int spread_items(char **args, int argc, const char *items, int nitems) {
+    for (int i = 0; i < nitems; i++) {
+        args[argc++] = (char *)items;
+        items += strlen(items) + 1;
+    }
+    return argc;
+}
+
+// Take an index off the array's pending ones: the lowest (index -1) or
+// a given one. Returns it, or -1 if it is not pending.
+static int array_take(job_array_t *a, int index) {
+    int span = a->last - a->first + 1;
+    if (index < 0) {
+        while (a->next <= a->last && a->taken &&
+               (a->taken[(a->next - a->first) / 64] & (1ULL << ((a->next - a->first) % 64)))) {
+            a->next++;
+        }
+        if (a->next > a->last) return -1;
+        a->pending--;
+        return a->next++;
+    }
+    
+    if (index < a->next || index > a->last) return -1;
+    int bit = index - a->first;
+    if (a->taken == NULL) {
+        a->taken = calloc((span + 63) / 64, sizeof(uint64_t));
+        if (a->taken == NULL) return -1;
+    }
+    if (a->taken[bit / 64] & (1ULL << (bit % 64))) return -1;
+    a->taken[bit / 64] |= 1ULL << (bit % 64);
+    a->pending--;
+    return index;
+}
+
+// Bring an array's place in the run queue in line with its counts: in
+// it while elements are pending and it is under its limit, gone (with a
+// summary) once nothing is pending or running. Safe to call any time.
+void array_update(int array_id) {
+    job_t *job = find_job_by_id(array_id);
+    if (job == NULL) return;
+    job_info_t *info = job_info(job);
+    job_array_t *a = info->array;
+    
+    if (a->pending == 0 && a->running == 0 && a->input != NULL) {
+        double secs = (now_ns() - job->started_ns) / 1e9;
+        printf("\n[%d] Parallel done: %lld items in %d jobs, %.2fs (%.0f items/s), %d failed%s: %s\n",
+               array_id, a->items, a->done + a->failed, secs, secs > 0 ? a->items / secs : 0.0,
+               a->failed, a->cancelled ? ", rest of input cancelled" : "", job_command(job));
+        notify_pending = 1;
+        info->status = a->failed + a->cancelled > 0 ? 1 : 0;
+        delete_job(job);
+        return;
+    }
+    if (a->pending == 0 && a->running == 0) {
+        printf("\n[%d] Array done: %d ok, %d failed, %d cancelled: %s\n", array_id,
+               a->done, a->failed, a->cancelled, job_command(job));
+        notify_pending = 1;
+        info->status = a->failed + a->cancelled > 0 ? 1 : 0;
+        delete_job(job);
+        return;
+    }
+    if (job->state != QUEUED || info->heap_pos >= 0 || a->pending == 0 ||
+        (a->limit > 0 && a->running >= a->limit)) {
+        return;
+    }
+    if (enqueue_job(job) < 0) {
+        printf("\n[%d] Job table: out of memory, %d elements cancelled: %s\n", array_id,
+               a->pending, job_command(job));
+        notify_pending = 1;
+        a->cancelled += a->pending;
+        a->pending = 0;
+        array_update(array_id);
+    }
+}
+
+// Start element index of an array, already taken off its pending ones,
+// with {} standing for items (nitems of them, packed); items NULL means
+// the index. NULL if it could not be started, which counts as a failure.
+static job_t* array_start(job_t *array_job, int index, const char *items, int nitems) {
+    int array_id = array_job->job_id;
+    job_info_t *info = job_info(array_job);
+    job_array_t *a = info->array;
+    char *args[MAX_ARGS];
+    char words[ARRAY_CMD_MAX];
+    char cmd[ARRAY_CMD_MAX] = "";
+    char num[16];
+    char output[PATH_MAX];
+    job_opts_t opts = a->opts;
+    opts.priority = info->priority;  // 'renice' changes the array's
+    
+    if (items == NULL) {
+        snprintf(num, sizeof(num), "%d", index);
+        items = num;
+        nitems = 1;
+    }
+    
+    // The template with {} filled in, its words packed into words[]. For
+    // 'parallel', a lone {} (or the end of a template without one) takes
+    // each item as a word of its own.
+    const char *word = info->argv;
+    char *w = words;
+    int argc = 0;
+    int ok = 1;
+    for (int i = 0; i < info->argc && ok; i++) {
+        if (a->input && strcmp(word, "{}") == 0) {
+            argc = spread_items(args, argc, items, nitems);
+        } else {
+            args[argc] = expand_items(w, words + sizeof(words) - w, word, items, nitems);
+            ok = args[argc] != NULL;
+            if (ok) w += strlen(args[argc++]) + 1;
+        }
+        word += strlen(word) + 1;
+    }
+    if (a->input && a->append) {
+        argc = spread_items(args, argc, items, nitems);
+    }
+    args[argc] = NULL;
+    for (int i = 0; i < argc && ok; i++) {
+        ok = strlen(cmd) + strlen(args[i]) + 2 < sizeof(cmd);
+        if (ok) strcat(strcat(cmd, args[i]), " ");
+    }
+    if (ok && opts.output != NULL) {
+        opts.output = expand_items(output, sizeof(output), opts.output, items, nitems);
+        ok = opts.output != NULL;
+    }
+    
+    job_t *job = NULL;
+    if (!ok) {
+        printf("\n[%d.%d] Command too long after expanding {}\n", array_id, index);
+    } else {
+        job = create_job(next_element_id++, args, cmd, &opts, a->auto_sched);
+    }
+    if (job == NULL) {
+        a->failed++;
+        notify_pending = 1;
+        array_update(array_id);
+        return NULL;
+    }
+    
+    job_info(job)->array_id = array_id;
+    job_info(job)->array_index = index;
+    a->running++;
+    // A failed launch deletes the element, which counts it
+    int rc = launch_job(job);
+    array_update(array_id);
+    return rc == 0 ? job : NULL;
+}
+
+// The array reached the front of the run queue: start its next element,
+// unless its deadline has passed
+static void array_start_next(job_t *array_job) {
+    job_array_t *a = job_info(array_job)->array;
+    
+    if (a->opts.deadline_ns > 0 && now_ns() >= a->opts.deadline_ns) {
+        printf("\n[%d] Deadline passed, %d elements cancelled: %s\n", array_job->job_id,
+               a->pending, job_command(array_job));
+        notify_pending = 1;
+        a->cancelled += a->pending;
+        a->pending = 0;
+        array_update(array_job->job_id);
+        return;
+    }
+    if (a->input == NULL) {
+        int index = array_take(a, -1);
+        if (index >= 0) {
+            array_start(array_job, index, NULL, 0);
+        }
+        return;
+    }
+    
+    // Copied out of the reader, which reuses its buffer
+    char items[ARRAY_CMD_MAX];
+    size_t used = 0;
+    int nitems = 0;
+    char *item;
+    size_t len;
+    while (nitems < a->batch && used < sizeof(items) &&
+           (item = reader_next(a->input, &len)) != NULL) {
+        if (used + len + 1 > sizeof(items)) {
+            printf("\n[%d] parallel: item too long, skipped: %.40s...\n", array_job->job_id, item);
+            notify_pending = 1;
+            a->failed++;
+            continue;
+        }
+        memcpy(items + used, item, len + 1);
+        used += len + 1;
+        nitems++;
+    }
+    a->items += nitems;
+    if (nitems == 0) {
+        if (a->input->error) {
+            printf("\n[%d] parallel: reading input: %s\n", array_job->job_id,
+                   strerror(a->input->error));
+            notify_pending = 1;
+            a->failed++;
+        }
+        a->pending = 0;
+        array_update(array_job->job_id);
+        return;
+    }
+    array_start(array_job, a->next++, items, nitems);
+}
+
+// Ids of an array's elements in the job table; *ids is malloc'd. -1 if
+// out of memory.
+static int array_elements(int array_id, int **ids) {
+    int n = 0;
+    int cap = job_info(find_job_by_id(array_id))->array->running;
+    
+    *ids = malloc((cap ? cap : 1) * sizeof(int));
+    if (*ids == NULL) return -1;
+    for (int slot = job_head; slot != NO_SLOT && n < cap; slot = job_at(slot)->next) {
+        job_t *job = job_at(slot);
+        if (job_info(job)->array_id == array_id) {
+            (*ids)[n++] = job->job_id;
+        }
+    }
+    return n;
+}
+
+// Cancel an array's pending elements and send sig to the running ones,
+// which are not retried. The array goes once the last one is reaped.
+static void array_cancel(job_t *array_job, int sig) {
+    int array_id = array_job->job_id;
+    job_array_t *a = job_info(array_job)->array;
+    int *ids;
+    
+    a->cancelled += a->pending;
+    a->pending = 0;
+    dequeue_job(array_job);
+    int n = array_elements(array_id, &ids);
+    for (int i = 0; i < n; i++) {
+        job_t *job = find_job_by_id(ids[i]);
+        if (job == NULL) continue;
+        if (job->state == QUEUED || job->state == BACKOFF) {
+            delete_job(job);
+            continue;
+        }
+        free(job_info(job)->retry);
+        job_info(job)->retry = NULL;
+        if (job->state == STOPPED) {
+            signal_job(job, SIGCONT);
+            job->state = RUNNING;
+        }
+        signal_job(job, sig);
+    }
+    free(ids);
+    array_update(array_id);
+}
+
+// bg on an array: continue its stopped elements; a policy other than -1
+// also applies to them and to the elements still to start
+static void array_bg(job_t *array_job, int policy) {
+    int array_id = array_job->job_id;
+    job_array_t *a = job_info(array_job)->array;
+    int *ids;
+    int continued = 0;
+    
+    if (policy >= 0) {
+        int nice = a->opts.sched.nice;
+        int set = a->opts.sched.set & JOB_SCHED_NICE;
+        sched_class(policy, &a->opts.sched);
+        a->opts.sched.nice = nice;
+        a->opts.sched.set |= set;
+        a->auto_sched = 0;
+    }
+    int n = array_elements(array_id, &ids);
+    for (int i = 0; i < n; i++) {
+        job_t *job = find_job_by_id(ids[i]);
+        if (job == NULL) continue;
+        if (policy >= 0) {
+            if (sched_job(job, &a->opts.sched) < 0) {
+                printf("bg: job [%s]: %s\n", job_name(job), strerror(errno));
+            }
+            job_info(job)->auto_sched = 0;
+        }
+        if (job->state == STOPPED) {
+            signal_job(job, SIGCONT);
+            job->state = RUNNING;
+            continued++;
+        }
+    }
+    free(ids);
+    printf("Job [%d] array: %d elements continued: %s\n", array_id, continued,
+           job_command(array_job));
+}
+
+// Enter an array job: argv is the template for its elements, which get
+// opts; the array itself only gets their priority and dependencies
+job_t* array_submit(char **argv, const char *cmd, const job_opts_t *opts,
+                    int auto_sched, int first, int last, int limit,
+                    item_reader_t *input, int batch) {
+    job_opts_t own;
+    memset(&own, 0, sizeof(own));
+    own.priority = opts->priority;
+    own.node = -1;
+    job_t *job = create_job(0, argv, cmd, &own, 0);
+    if (job == NULL) {
+        return NULL;
+    }
+    
+    // The elements' option strings are kept after the struct
+    size_t out_len = opts->output ? strlen(opts->output) + 1 : 0;
+    size_t cg_len = opts->cgroup ? strlen(opts->cgroup) + 1 : 0;
+    job_array_t *a = malloc(sizeof(job_array_t) + out_len + cg_len);
+    if (a == NULL) {
+        printf("Job table: out of memory\n");
+        delete_job(job);
+        return NULL;
+    }
+    a->first = a->next = first;
+    a->last = last;
+    a->taken = NULL;
+    a->limit = limit;
+    a->pending = input ? 1 : last - first + 1;
+    a->running = a->done = a->failed = a->cancelled = 0;
+    a->input = input;
+    a->batch = batch;
+    a->append = 1;
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (strstr(argv[i], "{}") != NULL) a->append = 0;
+    }
+    a->items = 0;
+    a->opts = *opts;
+    a->opts.ndeps = 0;
+    if (opts->output) {
+        a->opts.output = memcpy((char *)(a + 1), opts->output, out_len);
+    }
+    if (opts->cgroup) {
+        a->opts.cgroup = memcpy((char *)(a + 1) + out_len, opts->cgroup, cg_len);
+    }
+    a->auto_sched = auto_sched;
+    job_info(job)->array = a;
+    return job;
+}
+
+// Job a 'fg', 'bg', 'kill' or 'output' argument names: "N", or "A.i" for
+// element i of array A. An element not started yet gives its array, with
+// *index set to i; *index is -1 otherwise.
+static job_t* find_job_by_name(const char *name, int *index) {
+    char *end;
+    long id = strtol(name, &end, 10);
+    
+    *index = -1;
+    if (end == name || id <= 0 || id >= ARRAY_ELEMENT_IDS) return NULL;
+    job_t *job = find_job_by_id(id);
+    if (*end == '\0') return job;
+    if (*end != '.' || job == NULL || job_info(job)->array == NULL) return NULL;
+    
+    const char *i_str = end + 1;
+    long i = strtol(i_str, &end, 10);
+    job_array_t *a = job_info(job)->array;
+    if (end == i_str || *end != '\0' || i < a->first || i > a->last) return NULL;
+    for (int slot = job_head; slot != NO_SLOT; slot = job_at(slot)->next) {
+        job_info_t *info = job_info(job_at(slot));
+        if (info->array_id == id && info->array_index == i) return job_at(slot);
+    }
+    int bit = i - a->first;
+    if (a->input != NULL || i < a->next || (a->taken && (a->taken[bit / 64] & (1ULL << (bit % 64))))) {
+        return NULL;  // Finished or cancelled
+    }
+    *index = i;
+    return job;
+}
+
+// Pending queue: binary min-heap on (priority, job id). Each job's
+// heap_pos tracks its entry, so removal and re-prioritising are O(log n).
+static int queue_less(const queue_entry_t *a, const queue_entry_t *b) {
+    return a->priority != b->priority ? a->priority < b->priority : a->seq < b->seq;
+}
+
+static void queue_place(int pos, queue_entry_t entry) {
+    run_queue[pos] = entry;
+    job_info(job_at(entry.slot))->heap_pos = pos;
+}
+
+static void queue_sift_up(int pos) {
+    queue_entry_t entry = run_queue[pos];
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (!queue_less(&entry, &run_queue[parent])) break;
+        queue_place(pos, run_queue[parent]);
+        pos = parent;
+    }
+    queue_place(pos, entry);
+}
+
+static void queue_sift_down(int pos) {
+    queue_entry_t entry = run_queue[pos];
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= queue_len) break;
+        if (child + 1 < queue_len && queue_less(&run_queue[child + 1], &run_queue[child])) {
+            child++;
+        }
+        if (!queue_less(&run_queue[child], &entry)) break;
+        queue_place(pos, run_queue[child]);
+        pos = child;
+    }
+    queue_place(pos, entry);
+}
+
+int enqueue_job(job_t *job) {
+    if (queue_len == queue_cap) {
+        int cap = queue_cap ? queue_cap * 2 : 64;
+        queue_entry_t *grown = realloc(run_queue, cap * sizeof(*grown));
+        if (grown == NULL) return -1;
+        run_queue = grown;
+        queue_cap = cap;
+    }
+    
+    queue_entry_t entry = { job_info(job)->priority, job->job_id, job->slot };
+    run_queue[queue_len] = entry;
+    queue_sift_up(queue_len++);
+    return 0;
+}
+
+void dequeue_job(job_t *job) {
+    job_info_t *info = job_info(job);
+    int pos = info->heap_pos;
+    if (pos < 0) return;  // Not in the queue
+    
+    info->heap_pos = -1;
+    if (pos != --queue_len) {
+        // Fill the hole with the last entry, which may need to go either way
+        int moved = run_queue[queue_len].slot;
+        queue_place(pos, run_queue[queue_len]);
+        queue_sift_up(pos);
+        queue_sift_down(job_info(job_at(moved))->heap_pos);
+    }
+    
+    // Give memory back after a large burst has drained
+    if (queue_cap > 64 && queue_len < queue_cap / 4) {
+        queue_entry_t *shrunk = realloc(run_queue, queue_cap / 2 * sizeof(*shrunk));
+        if (shrunk != NULL) {
+            run_queue = shrunk;
+            queue_cap /= 2;
+        }
+    }
+}
+
+// Change a queued job's priority in place
+void requeue_job(job_t *job, int priority) {
+    job_info_t *info = job_info(job);
+    info->priority = priority;
+    if (info->heap_pos < 0) return;
+    
+    run_queue[info->heap_pos].priority = priority;
+    queue_sift_up(info->heap_pos);
+    queue_sift_down(info->heap_pos);
+}
+
+// Launch queued jobs while there is room under max_running
+void dispatch_queued() {
+    while (queue_len > 0 && (max_running == 0 || active_jobs < max_running)) {
+        job_t *job = job_at(run_queue[0].slot);
+        
+        dequeue_job(job);
+        if (job_info(job)->array != NULL) {
+            array_start_next(job);
+            continue;
+        }
+        if (launch_job(job) == 0) {
+            printf("\n[%s] %d Started: %s\n", job_name(job), job->pid, job_command(job));
+        }
+        notify_pending = 1;
+    }
+}
+
+void update_job_state(pid_t pid, job_state_t state) {
+    job_t *job = find_job_by_pid(pid);
+    if (job) {
+        job->state = state;
+    }
+}
+
+job_t* find_job_by_pid(pid_t pid) {
+    int slot = index_lookup(&pid_index, pid);
+    return slot == NO_SLOT ? NULL : job_at(slot);
+}
+
+job_t* find_job_by_id(int job_id) {
+    if (job_id <= 0) return NULL;
+    int slot = index_lookup(&id_index, job_id);
+    return slot == NO_SLOT ? NULL : job_at(slot);
+}
+
+// Split PATH into path_dirs and record each directory's mtime
+static void cmd_cache_load_path(const char *env) {
+    for (int i = 0; i < path_ndirs; i++) {
+        free(path_dirs[i]);
+    }
+    free(path_dirs);
+    free(path_mtimes);
+    free(cmd_path_env);
+    path_dirs = NULL;
+    path_mtimes = NULL;
+    path_ndirs = 0;
+    
+    cmd_path_env = strdup(env);
+    if (cmd_path_env == NULL) return;
+    
+    int n = 1;
+    for (const char *p = env; *p; p++) {
+        if (*p == ':') n++;
+    }
+    path_dirs = calloc(n, sizeof(char *));
+    path_mtimes = calloc(n, sizeof(struct timespec));
+    if (path_dirs == NULL || path_mtimes == NULL) return;
+    
+    const char *start = env;
+    for (int i = 0; i < n; i++) {
+        const char *end = strchr(start, ':');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        // An empty element means the current directory
+        path_dirs[i] = len ? strndup(start, len) : strdup(".");
+        if (path_dirs[i] == NULL) break;
+        
+        struct stat st;
+        if (stat(path_dirs[i], &st) == 0) {
+            path_mtimes[i] = st.st_mtim;
+        }
+        path_ndirs = i + 1;
+        start = end ? end + 1 : start + len;
+    }
+    path_checked_ns = now_ns();
+}
+
+// Drop cached entries found in PATH directory min_dir or later
+void cmd_cache_flush(int min_dir) {
+    cmd_entry_t *old = cmd_cache;
+    unsigned old_size = cmd_cache ? 1u << cmd_cache_bits : 0;
+    
+    cmd_cache = NULL;
+    cmd_cache_bits = 0;
+    cmd_cache_count = 0;
+    if (old == NULL) return;
+    
+    cmd_cache = calloc(old_size, sizeof(cmd_entry_t));
+    cmd_cache_bits = cmd_cache ? __builtin_ctz(old_size) : 0;
+    unsigned mask = old_size - 1;
+    for (unsigned i = 0; i < old_size; i++) {
+        if (old[i].name == NULL) continue;
+        if (old[i].dir >= min_dir || cmd_cache == NULL) {
+            free(old[i].name);
+            free(old[i].path);
+            continue;
+        }
+        unsigned j = str_hash(old[i].name, strlen(old[i].name)) & mask;
+        while (cmd_cache[j].name != NULL) {
+            j = (j + 1) & mask;
+        }
+        cmd_cache[j] = old[i];
+        cmd_cache_count++;
+    }
+    free(old);
+}
+
+// Invalidate on a PATH change, and (rate limited) when a PATH directory
+// changes: a new file there can shadow anything found in later ones
+static void cmd_cache_validate() {
+    const char *env = getenv("PATH");
+    if (env == NULL) env = "/usr/local/bin:/usr/bin:/bin";
+    
+    if (cmd_path_env == NULL || strcmp(env, cmd_path_env) != 0) {
+        cmd_cache_flush(0);
+        cmd_cache_load_path(env);
+        return;
+    }
+    
+    int64_t now = now_ns();
+    if (now - path_checked_ns < CMD_CACHE_RECHECK_NS) return;
+    path_checked_ns = now;
+    
+    for (int i = 0; i < path_ndirs; i++) {
+        struct stat st;
+        struct timespec mtime = { 0, 0 };
+        if (stat(path_dirs[i], &st) == 0) {
+            mtime = st.st_mtim;
+        }
+        if (mtime.tv_sec != path_mtimes[i].tv_sec ||
+            mtime.tv_nsec != path_mtimes[i].tv_nsec) {
+            cmd_cache_flush(i);
+            for (; i < path_ndirs; i++) {
+                if (stat(path_dirs[i], &st) == 0) {
+                    path_mtimes[i] = st.st_mtim;
+                } else {
+                    path_mtimes[i] = (struct timespec){ 0, 0 };
+                }
+            }
+            return;
+        }
+    }
+}
+
+// Map a command name to the executable to run, walking PATH only on a
+// cache miss. Names containing '/' are used as given. Returns NULL if
+// nothing executable is found; the result is valid until the next call.
+const char* resolve_command(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    
+    cmd_cache_validate();
+    uint32_t hash = str_hash(name, strlen(name));
+    if (cmd_cache != NULL) {
+        unsigned mask = (1u << cmd_cache_bits) - 1;
+        for (unsigned i = hash & mask; cmd_cache[i].name != NULL; i = (i + 1) & mask) {
+            if (strcmp(cmd_cache[i].name, name) == 0) {
+                cmd_cache[i].hits++;
+                return cmd_cache[i].path;
+            }
+        }
+    }
+    
+    // Miss: search PATH like execvp would
+    static char found[PATH_MAX];
+    int dir;
+    for (dir = 0; dir < path_ndirs; dir++) {
+        struct stat st;
+        snprintf(found, sizeof(found), "%s/%s", path_dirs[dir], name);
+        if (stat(found, &st) == 0 && S_ISREG(st.st_mode) && access(found, X_OK) == 0) {
+            break;
+        }
+    }
+    if (dir == path_ndirs) {
+        return NULL;
+    }
+    
+    // Keep the cache at most half full; if it cannot grow, just don't cache
+    if (cmd_cache == NULL || (cmd_cache_count + 1) * 2 > (1u << cmd_cache_bits)) {
+        unsigned bits = cmd_cache ? cmd_cache_bits + 1 : 4;
+        cmd_entry_t *grown = calloc(1u << bits, sizeof(cmd_entry_t));
+        if (grown == NULL) return found;
+        
+        cmd_entry_t *old = cmd_cache;
+        unsigned old_size = old ? 1u << cmd_cache_bits : 0;
+        unsigned mask = (1u << bits) - 1;
+        for (unsigned i = 0; i < old_size; i++) {
+            if (old[i].name == NULL) continue;
+            unsigned j = str_hash(old[i].name, strlen(old[i].name)) & mask;
+            while (grown[j].name != NULL) {
+                j = (j + 1) & mask;
+            }
+            grown[j] = old[i];
+        }
+        free(old);
+        cmd_cache = grown;
+        cmd_cache_bits = bits;
+    }
+    
+    char *name_copy = strdup(name);
+    char *path_copy = strdup(found);
+    if (name_copy == NULL || path_copy == NULL) {
+        free(name_copy);
+        free(path_copy);
+        return found;
+    }
+    
+    unsigned mask = (1u << cmd_cache_bits) - 1;
+    unsigned i = hash & mask;
+    while (cmd_cache[i].name != NULL) {
+        i = (i + 1) & mask;
+    }
+    cmd_cache[i] = (cmd_entry_t){ name_copy, path_copy, dir, 1 };
+    cmd_cache_count++;
+    return path_copy;
+}
+
+void list_cmd_cache() {
+    if (cmd_cache_count == 0) {
+        printf("hash: hash table empty\n");
+        return;
+    }
+    
+    printf("hits    command\n");
+    for (unsigned i = 0; i < (1u << cmd_cache_bits); i++) {
+        if (cmd_cache[i].name != NULL) {
+            printf("%4u    %s\n", cmd_cache[i].hits, cmd_cache[i].path);
+        }
+    }
+}
+
+// Header and row of the resource columns in 'jobs -l' and 'history'
+static void print_usage_header() {
+    printf("    Wall     User      Sys  MaxRSS(KB)  MinFlt  MajFlt    VCsw    ICsw  ");
+    printf("  IPC  CacheMPKI  BrMPKI  CgPeak(KB)  Thrtl(s)  OOM  ");
+}
+
+static void print_usage(int64_t wall_ns, const job_usage_t *u) {
+    printf("%8.2f %8.2f %8.2f  %10ld %7ld %7ld %7ld %7ld  ",
+           wall_ns / 1e9, u->user_us / 1e6, u->sys_us / 1e6, u->maxrss_kb,
+           u->minflt, u->majflt, u->nvcsw, u->nivcsw);
+    
+    // Instructions per cycle; misses per thousand instructions
+    double instr = u->perf[PERF_INSTRUCTIONS];
+    if (instr > 0 && u->perf[PERF_CYCLES] > 0) {
+        printf("%5.2f  %9.2f  %6.2f  ", instr / u->perf[PERF_CYCLES],
+               u->perf[PERF_CACHE_MISSES] * 1000 / instr,
+               u->perf[PERF_BRANCH_MISSES] * 1000 / instr);
+    } else {
+        printf("%5s  %9s  %6s  ", "-", "-", "-");
+    }
+    
+    if (u->cg_peak_kb > 0 || u->cg_throttled_us > 0 || u->cg_oom_kills > 0) {
+        printf("%10ld  %8.2f  %3ld  ", u->cg_peak_kb, u->cg_throttled_us / 1e6, u->cg_oom_kills);
+    } else {
+        printf("%10s  %8s  %3s  ", "-", "-", "-");
+    }
+}
+
+// Add what /proc knows about a live process; ru_maxrss's live equivalent
+// is VmHWM
+static void proc_usage(pid_t pid, job_usage_t *u) {
+    static long ticks = 0;
+    char path[64];
+    char buf[1024];
+    
+    if (ticks == 0) ticks = sysconf(_SC_CLK_TCK);
+    
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return;
+    if (fgets(buf, sizeof(buf), f) != NULL) {
+        // Fields after the command name, which may itself contain spaces
+        char *p = strrchr(buf, ')');
+        unsigned long minflt, majflt, utime, stime;
+        if (p != NULL &&
+            sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+                   &minflt, &majflt, &utime, &stime) == 4) {
+            u->minflt += minflt;
+            u->majflt += majflt;
+            u->user_us += (int64_t)utime * 1000000 / ticks;
+            u->sys_us += (int64_t)stime * 1000000 / ticks;
+        }
+    }
+    fclose(f);
+    
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    f = fopen(path, "r");
+    if (f == NULL) return;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        long n;
+        if (sscanf(buf, "VmHWM: %ld", &n) == 1) {
+            u->maxrss_kb += n;
+        } else if (sscanf(buf, "voluntary_ctxt_switches: %ld", &n) == 1) {
+            u->nvcsw += n;
+        } else if (sscanf(buf, "nonvoluntary_ctxt_switches: %ld", &n) == 1) {
+            u->nivcsw += n;
+        }
+    }
+    fclose(f);
+}
+
+void list_jobs(int long_format) {
+    if (job_count == 0) {
+        printf("No jobs\n");
+        return;
+    }
+    
+    if (long_format) {
+        printf("\nJob ID  PID     State     ");
+        print_usage_header();
+        printf("Command\n");
+        for (int slot = job_head; slot != NO_SLOT; slot = job_at(slot)->next) {
+            job_t *job = job_at(slot);
+            job_info_t *info = job_info(job);
+            job_usage_t usage = info->usage;
+            int64_t wall_ns = 0;
+            
+            // Reaped pipeline stages so far, plus whatever is still running
+            if (job->pid > 0) {
+                wall_ns = now_ns() - job->started_ns;
+                if (info->cgroup != NULL && !info->cgroup->named) {
+                    cgroup_usage(info->cgroup, &usage);
+                }
+                if (info->pipeline == NULL) {
+                    proc_usage(job->pid, &usage);
+                    perf_read(&info->perf, &usage);
+                }
+                for (int i = 0; info->pipeline && i < info->pipeline->nstages; i++) {
+                    if (info->pipeline->stages[i].pidfd >= 0) {
+                        proc_usage(info->pipeline->stages[i].pid, &usage);
+                        perf_read(&info->pipeline->stages[i].perf, &usage);
+                    }
+                }
+            }
+            
+            char pid_str[16] = "-";
+            if (job->pid > 0) {
+                snprintf(pid_str, sizeof(pid_str), "%d", job->pid);
+            }
+            const char *name = job_name(job);
+            printf("[%s]%*s%-7s %-9s ", name, strlen(name) < 2 ? 4 : 1, "",
+                   pid_str, info->array != NULL && job->state != WAITING ? "Array" :
+                   job->state == RUNNING ? "Running" :
+                   job->state == STOPPED ? "Stopped" :
+                   job->state == WAITING ? "Waiting" :
+                   job->state == BACKOFF ? "Backoff" : "Queued");
+            print_usage(wall_ns, &usage);
+            printf("%s\n", job_command(job));
+        }
+        printf("\n");
+        return;
+    }
+    
+    printf("\nJob ID  PID     State     Prio  Node  Limit   Try    Command\n");
+    printf("------  ------  --------  ----  ----  ------  -----  -------\n");
+    for (int slot = job_head; slot != NO_SLOT; slot = job_at(slot)->next) {
+        job_t *job = job_at(slot);
+        const char *state_str;
+        switch (job->state) {
+            case QUEUED: state_str = "Queued"; break;
+            case WAITING: state_str = "Waiting"; break;
+            case BACKOFF: state_str = "Backoff"; break;
+            case RUNNING: state_str = "Running"; break;
+            case STOPPED: state_str = "Stopped"; break;
+            case DONE: state_str = "Done"; break;
+            default: state_str = "Unknown";
+        }
+        job_info_t *info = job_info(job);
+        if (info->array != NULL && job->state != WAITING) {
+            state_str = "Array";
+        }
+        char pid_str[16] = "-";
+        if (job->pid > 0) {
+            snprintf(pid_str, sizeof(pid_str), "%d", job->pid);
+        }
+        // Node it runs on, or the one it will be started on
+        int node = info->node >= 0 ? info->node : info->node_req;
+        char node_str[16] = "-";
+        if (node >= 0) {
+            snprintf(node_str, sizeof(node_str), "%d", numa_nodes[node].id);
+        }
+        // Time left before its timer fires: the SIGTERM, after it the SIGKILL,
+        // or in BACKOFF the next attempt
+        char limit_str[32] = "-";
+        if (info->timer.pprev != NULL) {
+            int64_t left = wheel_base_ns + (int64_t)info->timer.expires * WHEEL_TICK_NS - now_ns();
+            format_duration(left > 0 ? left : 0, limit_str, sizeof(limit_str));
+        }
+        // Attempt, of the most it may get
+        char try_str[32] = "-";
+        if (info->retry != NULL || info->attempt > 1) {
+            snprintf(try_str, sizeof(try_str), "%d/%d", info->attempt,
+                     info->retry ? info->retry->retries + 1 : info->attempt);
+        }
+        printf("[%s]     %s     %s   %4d  %4s  %-6s  %-5s  %s\n", job_name(job), pid_str,
+               state_str, info->priority, node_str, limit_str, try_str, job_command(job));
+        if (info->array != NULL) {
+            const job_array_t *a = info->array;
+            if (a->input != NULL) {
+                printf("        %d running, %lld items read, %d done, %d failed\n",
+                       a->running, a->items, a->done, a->failed);
+            } else {
+                printf("        %d running, %d pending, %d done, %d failed, %d cancelled\n",
+                       a->running, a->pending, a->done, a->failed, a->cancelled);
+            }
+        }
+    }
+    printf("\n");
+}
+
+// The last count completed jobs, oldest first
+void list_history(int count) {
+    if (history_len == 0) {
+        printf("No completed jobs\n");
+        return;
+    }
+    if (count <= 0 || count > history_len) count = history_len;
+    
+    printf("\nJob ID  Status  ");
+    print_usage_header();
+    printf("Command\n");
+    for (int n = count; n > 0; n--) {
+        job_record_t *rec = &history[(history_next - n + JOB_HISTORY) % JOB_HISTORY];
+        char id_str[16] = "-";
+        if (rec->job_id > 0) {
+            snprintf(id_str, sizeof(id_str), "[%d]", rec->job_id);
+        }
+        printf("%-7s %6d  ", id_str, rec->status);
+        print_usage(rec->wall_ns, &rec->usage);
+        printf("%s\n", arena.data + rec->command + ARENA_HDR_SIZE);
+    }
+    printf("\n");
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentiles of one history column, sorted in place
+static void print_percentiles(const char *label, int64_t *values, int n, double scale) {
+    static const int pcts[] = { 50, 90, 99 };
+    
+    qsort(values, n, sizeof(*values), cmp_int64);
+    printf("%-12s", label);
+    for (int i = 0; i < 3; i++) {
+        int rank = (pcts[i] * n + 99) / 100;
+        printf(" %10.2f", values[rank > 0 ? rank - 1 : 0] / scale);
+    }
+    printf(" %10.2f\n", values[n - 1] / scale);
+}
+
+// Totals since startup, percentiles over the jobs still in the history
+void print_stats() {
+    printf("Completed jobs: %ld (%ld failed)\n", total_jobs, total_failed);
+    if (total_jobs == 0) return;
+    printf("Total wall %.2fs, user %.2fs, sys %.2fs, %ld major faults\n",
+           total_wall_ns / 1e9, total_usage.user_us / 1e6, total_usage.sys_us / 1e6,
+           total_usage.majflt);
+    if (total_usage.perf[PERF_CYCLES] > 0) {
+        printf("Total cycles %.3fG, instructions %.3fG (IPC %.2f)\n",
+               total_usage.perf[PERF_CYCLES] / 1e9, total_usage.perf[PERF_INSTRUCTIONS] / 1e9,
+               (double)total_usage.perf[PERF_INSTRUCTIONS] / total_usage.perf[PERF_CYCLES]);
+    }
+    
+    int64_t *values = history_len ? malloc(history_len * sizeof(*values)) : NULL;
+    if (values == NULL) return;
+    
+    printf("\nLast %d jobs       p50        p90        p99        max\n", history_len);
+    for (int i = 0; i < history_len; i++) values[i] = history[i].wall_ns;
+    print_percentiles("Wall (s)", values, history_len, 1e9);
+    for (int i = 0; i < history_len; i++) {
+        values[i] = history[i].usage.user_us + history[i].usage.sys_us;
+    }
+    print_percentiles("CPU (s)", values, history_len, 1e6);
+    for (int i = 0; i < history_len; i++) values[i] = history[i].usage.maxrss_kb;
+    print_percentiles("MaxRSS (MB)", values, history_len, 1024);
+    free(values);
+}
+
+// Duration with a unit that keeps it readable
+static void print_duration(int64_t ns) {
+    if (ns < 10000) {
+        printf(" %8lldns", (long long)ns);
+    } else if (ns < 10000000) {
+        printf(" %8.1fus", ns / 1e3);
+    } else if (ns < 10000000000LL) {
+        printf(" %8.1fms", ns / 1e6);
+    } else {
+        printf(" %8.2fs ", ns / 1e9);
+    }
+}
+
+static void print_latency_row(const char *label, const latency_hist_t *h) {
+    static const int permille[] = { 500, 900, 990, 999 };
+    
+    printf("%-12s %8llu", label, (unsigned long long)h->count);
+    if (h->count == 0) {
+        printf("\n");
+        return;
+    }
+    
+    // Walk the buckets once, reporting each nearest-rank percentile as
+    // its rank is passed
+    int p = 0;
+    uint64_t seen = 0;
+    for (int b = 0; b < LAT_BUCKETS && p < 4; b++) {
+        seen += h->buckets[b];
+        while (p < 4 && seen >= (permille[p] * h->count + 999) / 1000) {
+            int64_t v = latency_bucket_value(b);
+            print_duration(v < h->min ? h->min : v > h->max ? h->max : v);
+            p++;
+        }
+    }
+    print_duration(h->max);
+    print_duration(h->sum / (int64_t)h->count);
+    printf("\n");
+}
+
+// Launch (spawn call to exec), run (exec to exit) and reap (exit noticed
+// to reaped) latencies since startup or the last 'latency reset'
+void print_latency() {
+    printf("                count        p50        p90        p99       p999        max       mean\n");
+    print_latency_row("Launch", &launch_latency);
+    print_latency_row("Run", &run_latency);
+    print_latency_row("Reap", &reap_latency);
+}
+
+// Stop a job for good: cancel it if it has not started, else SIGKILL it
+// with no retries. An array has its pending elements cancelled and its
+// running ones killed.
+static void kill_job(job_t *job) {
+    job_info_t *info = job_info(job);
+    
+    if (info->array != NULL && job->state != WAITING) {
+        array_cancel(job, SIGKILL);
+        return;
+    }
+    if (job->state == QUEUED || job->state == WAITING || job->state == BACKOFF) {
+        delete_job(job);
+        return;
+    }
+    // Killed on purpose: not a failure to retry
+    free(info->retry);
+    info->retry = NULL;
+    signal_job(job, SIGKILL);
+}
+
+// Listen on a Unix socket at path, replacing any socket already open.
+// A stale socket file is removed; one another process still answers on
+// is left alone. Returns -1 after reporting an error.
+int control_open(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("control: %s: path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if (control_fd >= 0 && strcmp(path, control_path) == 0) return 0;
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("control: socket");
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 || errno == EAGAIN) {
+            printf("control: %s is in use\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    
+    // Only this user may connect: whoever can submit jobs runs commands
+    mode_t mask = umask(077);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rc < 0 || listen(fd, SOMAXCONN) < 0) {
+        printf("control: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    control_close();
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u64 = EV_CONTROL | CONTROL_LISTENER;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    control_fd = fd;
+    strcpy(control_path, path);
+    return 0;
+}
+
+static void control_drop(int slot) {
+    control_client_t *c = control_clients[slot];
+    close(c->fd);  // Also takes it out of the epoll set
+    if (c->wait_id) control_waiters--;
+    free(c->out);
+    free(c);
+    control_clients[slot] = NULL;
+    control_count--;
+}
+
+// Stop listening and drop every client
+void control_close() {
+    for (int i = 0; i < control_cap; i++) {
+        if (control_clients[i] != NULL) control_drop(i);
+    }
+    if (control_fd >= 0) {
+        close(control_fd);
+        unlink(control_path);
+        control_fd = -1;
+        control_path[0] = '\0';
+    }
+}
+
+// Write out what the client has pending; what the socket does not take
+// waits for EPOLLOUT. The client is dropped if it is done or has stopped
+// reading for too long.
+static void control_flush(int slot) {
+    control_client_t *c = control_clients[slot];
+    size_t done = 0;
+    
+    while (done < c->out_len) {
+        ssize_t n = send(c->fd, c->out + done, c->out_len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n < 0) {
+            control_drop(slot);
+            return;
+        }
+        done += n;
+    }
+    if (done > 0) {
+        memmove(c->out, c->out + done, c->out_len - done);
+        c->out_len -= done;
+    }
+    
+    if (c->out_len > CONTROL_OUT_MAX || (c->closing && c->out_len == 0 && c->wait_id == 0)) {
+        control_drop(slot);
+        return;
+    }
+    // Nothing more is read from a closing client; it only waits for replies
+    uint32_t events = (c->closing ? 0 : EPOLLIN) | (c->out_len > 0 ? EPOLLOUT : 0);
+    if (events != c->events) {
+        struct epoll_event ev = { .events = events };
+        ev.data.u64 = EV_CONTROL | slot;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+// Append to a client's reply; sent by the next control_flush()
+static void control_printf(control_client_t *c, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    
+    if (c->out_len + n + 1 > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + n + 1) cap *= 2;
+        char *grown = realloc(c->out, cap);
+        if (grown == NULL) return;
+        c->out = grown;
+        c->out_cap = cap;
+    }
+    va_start(ap, fmt);
+    vsnprintf(c->out + c->out_len, n + 1, fmt, ap);
+    va_end(ap);
+    c->out_len += n;
+}
+
+// Append str as a JSON string
+static void control_string(control_client_t *c, const char *str) {
+    control_printf(c, "\"");
+    for (const char *p = str; *p; p++) {
+        const char *run = p;
+        while (*p && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+        if (p > run) control_printf(c, "%.*s", (int)(p - run), run);
+        if (*p == '\0') break;
+        if (*p == '"' || *p == '\\') {
+            control_printf(c, "\\%c", *p);
+        } else {
+            control_printf(c, "\\u%04x", (unsigned char)*p);
+        }
+    }
+    control_printf(c, "\"");
+}
+
+// Take connections until none are waiting
+void control_accept() {
+    for (;;) {
+        int fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;  // EAGAIN, or out of fds: the rest wait in the backlog
+        }
+        
+        int slot = 0;
+        while (slot < control_cap && control_clients[slot] != NULL) slot++;
+        if (slot == control_cap) {
+            int cap = control_cap ? control_cap * 2 : 16;
+            control_client_t **grown = realloc(control_clients, cap * sizeof(*grown));
+            if (grown == NULL) {
+                close(fd);
+                continue;
+            }
+            memset(grown + control_cap, 0, (cap - control_cap) * sizeof(*grown));
+            control_clients = grown;
+            control_cap = cap;
+        }
+        control_client_t *c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        control_clients[slot] = c;
+        control_count++;
+        
+        struct epoll_event ev = { .events = EPOLLIN };
+        ev.data.u64 = EV_CONTROL | slot;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// Parse a JSON string at *p into buf (n bytes, truncating); \u escapes
+// above 0x7f become '?'. Returns -1 if malformed.
+static int json_string(const char **p, char *buf, size_t n) {
+    const char *s = *p;
+    size_t len = 0;
+    
+    if (*s++ != '"') return -1;
+    while (*s != '"') {
+        char ch = *s++;
+        if (ch == '\0') return -1;
+        if (ch == '\\') {
+            ch = *s++;
+            switch (ch) {
+                case 'n': ch = '\n'; break;
+                case 't': ch = '\t'; break;
+                case 'r': ch = '\r'; break;
+                case 'b': ch = '\b'; break;
+                case 'f': ch = '\f'; break;
+                case '"': case '\\': case '/': break;
+                case 'u': {
+                    char hex[5] = { 0 };
+                    for (int i = 0; i < 4; i++) {
+                        if (!strchr("0123456789abcdefABCDEF", *s) || *s == '\0') return -1;
+                        hex[i] = *s++;
+                    }
+                    long code = strtol(hex, NULL, 16);
+                    ch = code < 0x80 ? (char)code : '?';
+                    break;
+                }
+                default: return -1;
+            }
+        }
+        if (len + 1 < n) buf[len++] = ch;
+    }
+    buf[len] = '\0';
+    *p = s + 1;
+    return 0;
+}
+
+// A request: one flat JSON object per line, e.g. {"op":"kill","id":3}.
+// Fields other than these are ignored.
+typedef struct {
+    char op[16];
+    char cmd[MAX_LINE];
+    char id[32];            // A number or a string such as "3.5"
+} control_req_t;
+
+static int control_parse(const char *line, control_req_t *req) {
+    const char *p = line;
+    
+    memset(req, 0, sizeof(*req));
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p++ != '{') return -1;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '}') return 0;
+    for (;;) {
+        char key[16];
+        while (*p == ' ' || *p == '\t') p++;
+        if (json_string(&p, key, sizeof(key)) < 0) return -1;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p++ != ':') return -1;
+        while (*p == ' ' || *p == '\t') p++;
+        
+        char *dst = strcmp(key, "op") == 0 ? req->op : strcmp(key, "cmd") == 0 ? req->cmd :
+                    strcmp(key, "id") == 0 ? req->id : NULL;
+        size_t n = dst == req->cmd ? sizeof(req->cmd) : dst == req->op ? sizeof(req->op) :
+                   sizeof(req->id);
+        char skip[CONTROL_LINE_MAX];
+        if (*p == '"') {
+            if (json_string(&p, dst ? dst : skip, dst ? n : sizeof(skip)) < 0) return -1;
+        } else {
+            // A number, true, false or null; nested values are not accepted
+            const char *start = p;
+            while (*p && strchr("-+.eE0123456789truefalsn", *p)) p++;
+            if (p == start) return -1;
+            if (dst != NULL) snprintf(dst, n, "%.*s", (int)(p - start), start);
+        }
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (*p != '}') return -1;
+        break;
+    }
+    return 0;
+}
+
+static const char* control_state(const job_t *job) {
+    if (job_info(job)->array != NULL && job->state != WAITING) return "array";
+    switch (job->state) {
+        case QUEUED: return "queued";
+        case WAITING: return "waiting";
+        case BACKOFF: return "backoff";
+        case RUNNING: return "running";
+        case STOPPED: return "stopped";
+        default: return "done";
+    }
+}
+
+static void control_request(control_client_t *c, char *line) {
+    control_req_t req;
+    
+    if (control_parse(line, &req) < 0) {
+        control_printf(c, "{\"ok\":false,\"error\":\"malformed request\"}\n");
+        return;
+    }
+    
+    // submit: run cmd as if typed with "&" at the prompt
+    if (strcmp(req.op, "submit") == 0) {
+        char *args[MAX_ARGS];
+        int background;
+        parse_command(req.cmd, args, &background);
+        if (args[0] == NULL) {
+            control_printf(c, "{\"ok\":false,\"error\":\"empty command\"}\n");
+            return;
+        }
+        // Its notices show up at the terminal like any job's
+        if (at_prompt) printf("\n");
+        int job_id = next_job_id;
+        int ok = execute_command(args, 1);
+        notify_pending = 1;
+        if (!ok || next_job_id == job_id) {
+            control_printf(c, "{\"ok\":false,\"error\":\"rejected; the reason is on the shell's terminal\"}\n");
+            return;
+        }
+        control_printf(c, "{\"ok\":true,\"id\":%d}\n", job_id);
+        return;
+    }
+    
+    // list: every job in the table, elements of arrays included
+    if (strcmp(req.op, "list") == 0) {
+        control_printf(c, "{\"ok\":true,\"jobs\":[");
+        for (int slot = job_head; slot != NO_SLOT; slot = job_at(slot)->next) {
+            job_t *job = job_at(slot);
+            control_printf(c, "%s{\"id\":\"%s\",\"pid\":%d,\"state\":\"%s\",\"priority\":%d,"
+                           "\"attempt\":%d,\"command\":", slot == job_head ? "" : ",",
+                           job_name(job), job->pid, control_state(job),
+                           job_info(job)->priority, job_info(job)->attempt);
+            control_string(c, job_command(job));
+            control_printf(c, "}");
+        }
+        control_printf(c, "]}\n");
+        return;
+    }
+    
+    if (strcmp(req.op, "stats") == 0) {
+        control_printf(c, "{\"ok\":true,\"jobs\":%d,\"running\":%d,\"queued\":%d,"
+                       "\"completed\":%ld,\"failed\":%ld,\"wall_s\":%.3f,\"user_s\":%.3f,"
+                       "\"sys_s\":%.3f,\"clients\":%d}\n", job_count, active_jobs, queue_len,
+                       total_jobs, total_failed, total_wall_ns / 1e9,
+                       total_usage.user_us / 1e6, total_usage.sys_us / 1e6, control_count);
+        return;
+    }
     
-    if (pid < 0) {
-        perror("fork error");
-        return 0;
+    int is_kill = strcmp(req.op, "kill") == 0;
+    if (!is_kill && strcmp(req.op, "wait") != 0) {
+        control_printf(c, "{\"ok\":false,\"error\":\"unknown op\"}\n");
+        return;
+    }
+    int index;
+    job_t *job = find_job_by_name(req.id, &index);
+    if (job != NULL && index >= 0) {
+        control_printf(c, "{\"ok\":false,\"error\":\"not started\"}\n");
+        return;
     }
     
-    if (pid == 0) {
-        // Child process
-        // Restore default signal handlers
-        signal(SIGINT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
-        
-        // Create new process group for background jobs
-        if (background) {
-            setpgid(0, 0);
-        }
-        
-        // Execute command
-        if (execvp(args[0], args) < 0) {
-            printf("Command not found: %s\n", args[0]);
-            exit(1);
-        }
-    } else {
-        // Parent process
-        if (background) {
-            // Background job
-            char cmd[MAX_LINE] = "";
-            for (int i = 0; args[i] != NULL; i++) {
-                strcat(cmd, args[i]);
-                strcat(cmd, " ");
-            }
-            add_job(pid, cmd, RUNNING);
-            printf("[%d] %d %s\n", jobs[job_count-1].job_id, pid, cmd);
-        } else {
-            // Foreground job
-            wait_for_fg(pid);
+    // kill: as the 'kill' builtin
+    if (is_kill) {
+        if (job == NULL) {
+            control_printf(c, "{\"ok\":false,\"error\":\"no such job\"}\n");
+            return;
         }
+        control_printf(c, "{\"ok\":true,\"id\":\"%s\"}\n", job_name(job));
+        kill_job(job);
+        return;
     }
     
-    return 1;
-}
-
-void add_job(pid_t pid, const char *command, job_state_t state) {
-    if (job_count >= MAX_JOBS) {
-        printf("Job queue full\n");
+    // wait: answered when the job leaves the table; one that already has
+    // is answered from the history
+    if (c->wait_id != 0) {
+        control_printf(c, "{\"ok\":false,\"error\":\"already waiting\"}\n");
         return;
     }
-    
-    jobs[job_count].job_id = next_job_id++;
-    jobs[job_count].pid = pid;
-    jobs[job_count].state = state;
-    strncpy(jobs[job_count].command, command, MAX_LINE - 1);
-    job_count++;
+    if (job != NULL) {
+        c->wait_id = job->job_id;
+        control_waiters++;
+        return;
+    }
+    int job_id = atoi(req.id);
+    for (int n = 1; n <= history_len && job_id > 0; n++) {
+        job_record_t *rec = &history[(history_next - n + JOB_HISTORY) % JOB_HISTORY];
+        if (rec->job_id == job_id) {
+            control_printf(c, "{\"ok\":true,\"id\":\"%d\",\"status\":%d}\n", job_id, rec->status);
+            return;
+        }
+    }
+    control_printf(c, "{\"ok\":false,\"error\":\"no such job\"}\n");
 }
 
-void remove_job(pid_t pid) {
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].pid == pid) {
-            // Shift remaining jobs
-            for (int j = i; j < job_count - 1; j++) {
-                jobs[j] = jobs[j + 1];
-            }
-            job_count--;
+// A client's socket is readable or writable: answer each complete line
+void control_event(int slot, uint32_t events) {
+    control_client_t *c = control_clients[slot];
+    
+    if (c == NULL) return;  // Dropped earlier in this batch
+    if (c->closing && (events & (EPOLLHUP | EPOLLERR))) {
+        control_drop(slot);  // Gone for good; replies have nowhere to go
+        return;
+    }
+    while (!c->closing && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) {
+            c->closing = 1;
+            break;
+        }
+        c->in_len += n;
+        
+        char *line = c->in;
+        char *nl;
+        while ((nl = memchr(line, '\n', c->in + c->in_len - line)) != NULL) {
+            *nl = '\0';
+            if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+            if (*line != '\0') control_request(c, line);
+            line = nl + 1;
+        }
+        c->in_len -= line - c->in;
+        memmove(c->in, line, c->in_len);
+        if (c->in_len == sizeof(c->in)) {
+            control_printf(c, "{\"ok\":false,\"error\":\"request too long\"}\n");
+            c->closing = 1;
             break;
         }
+        // Do not let one busy client hold up the rest of the loop
+        if (c->out_len > CONTROL_OUT_MAX / 2) break;
     }
+    control_flush(slot);
 }
 
-void update_job_state(pid_t pid, job_state_t state) {
-    job_t *job = find_job_by_pid(pid);
-    if (job) {
-        job->state = state;
+// A job is leaving the table: answer the clients waiting for it. Only
+// queued here, since this may run inside control_event() for one of them;
+// control_flush_all() sends them.
+void control_job_done(job_t *job) {
+    for (int i = 0; i < control_cap; i++) {
+        control_client_t *c = control_clients[i];
+        if (c == NULL || c->wait_id != job->job_id) continue;
+        c->wait_id = 0;
+        control_waiters--;
+        control_printf(c, "{\"ok\":true,\"id\":\"%s\",\"status\":%d}\n", job_name(job),
+                       job_info(job)->status);
+        control_replies = 1;
     }
 }
 
-job_t* find_job_by_pid(pid_t pid) {
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].pid == pid) {
-            return &jobs[i];
-        }
+// Send the replies control_job_done() queued
+void control_flush_all() {
+    control_replies = 0;
+    for (int i = 0; i < control_cap; i++) {
+        if (control_clients[i] != NULL) control_flush(i);
     }
-    return NULL;
 }
 
-job_t* find_job_by_id(int job_id) {
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].job_id == job_id) {
-            return &jobs[i];
-        }
+// Run the event loop until the foreground job exits or stops. Stdin is
+// left to the job meanwhile.
+void wait_for_fg(pid_t pid, int pidfd) {
+    fg_pid = pid;
+    fg_pidfd = pidfd;
+    watch_stdin(0);
+    
+    while (fg_pid != 0) {
+        dispatch_events(-1);
     }
-    return NULL;
+    
+    watch_stdin(1);
 }
 
-void list_jobs() {
-    if (job_count == 0) {
-        printf("No jobs\n");
-        return;
-    }
+// Stop or resume reading commands while something runs in the foreground
+void watch_stdin(int on) {
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u64 = STDIN_FILENO;
     
-    printf("\nJob ID  PID     State     Command\n");
-    printf("------  ------  --------  -------\n");
-    for (int i = 0; i < job_count; i++) {
-        const char *state_str;
-        switch (jobs[i].state) {
-            case RUNNING: state_str = "Running"; break;
-            case STOPPED: state_str = "Stopped"; break;
-            case DONE: state_str = "Done"; break;
-            default: state_str = "Unknown";
-        }
-        printf("[%d]     %d     %s   %s\n", 
-               jobs[i].job_id, jobs[i].pid, state_str, jobs[i].command);
+    if (!stdin_polled) return;
+    epoll_ctl(epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDIN_FILENO, &ev);
+}
+
+// Run the event loop until a foreground 'parallel' finishes, or Ctrl+Z
+// leaves it to carry on in the background. Ctrl+C cancels it.
+void wait_for_array(int array_id) {
+    fg_array = array_id;
+    watch_stdin(0);
+    
+    while (fg_array != 0 && find_job_by_id(array_id) != NULL) {
+        dispatch_events(-1);
     }
-    printf("\n");
+    
+    fg_array = 0;
+    notify_pending = 0;
+    watch_stdin(1);
 }
 
-void wait_for_fg(pid_t pid) {
-    int status;
-    fg_pid = pid;
+// Print a job's captured output from offset from as it arrives, until
+// the job closes its output or Ctrl+C
+void follow_output(int job_id, uint64_t from) {
+    following = 1;
+    watch_stdin(0);
     
-    if (waitpid(pid, &status, WUNTRACED) < 0) {
-        if (errno != ECHILD) {
-            perror("waitpid error");
-        }
+    capture_t *c;
+    while ((c = find_capture(job_id)) != NULL) {
+        from = capture_print(c, from);
+        if (c->fd < 0 || !following) break;
+        dispatch_events(-1);
     }
     
-    fg_pid = 0;
+    following = 0;
+    watch_stdin(1);
 }
 
 int builtin_command(char **args) {
@@ -275,12 +5730,39 @@ int builtin_command(char **args) {
     
     // quit/exit command
     if (strcmp(args[0], "quit") == 0 || strcmp(args[0], "exit") == 0) {
+        control_close();
         exit(0);
     }
     
     // jobs command - list all jobs
     if (strcmp(args[0], "jobs") == 0) {
-        list_jobs();
+        list_jobs(args[1] != NULL && strcmp(args[1], "-l") == 0);
+        return 1;
+    }
+    
+    // history command - list completed jobs with their resource usage
+    if (strcmp(args[0], "history") == 0) {
+        list_history(args[1] ? atoi(args[1]) : 20);
+        return 1;
+    }
+    
+    // stats command - totals and percentiles over completed jobs
+    if (strcmp(args[0], "stats") == 0) {
+        print_stats();
+        return 1;
+    }
+    
+    // latency command - launch/run/reap latency percentiles, or reset them
+    if (strcmp(args[0], "latency") == 0) {
+        if (args[1] == NULL) {
+            print_latency();
+        } else if (strcmp(args[1], "reset") == 0) {
+            memset(&launch_latency, 0, sizeof(launch_latency));
+            memset(&run_latency, 0, sizeof(run_latency));
+            memset(&reap_latency, 0, sizeof(reap_latency));
+        } else {
+            printf("Usage: latency [reset]\n");
+        }
         return 1;
     }
     
@@ -290,41 +5772,107 @@ int builtin_command(char **args) {
             printf("Usage: fg <job_id>\n");
             return 1;
         }
-        int job_id = atoi(args[1]);
-        job_t *job = find_job_by_id(job_id);
+        int index;
+        job_t *job = find_job_by_name(args[1], &index);
         if (job == NULL) {
-            printf("Job [%d] not found\n", job_id);
+            printf("Job [%s] not found\n", args[1]);
             return 1;
         }
+        int job_id = job->job_id;
         
-        // Continue if stopped
-        if (job->state == STOPPED) {
-            kill(job->pid, SIGCONT);
+        if (job->state == WAITING) {
+            printf("Job [%d] is waiting for other jobs\n", job_id);
+            return 1;
+        }
+        if (job_info(job)->array != NULL && index < 0) {
+            printf("Job [%d] is an array; fg one element with fg %d.<index>\n", job_id, job_id);
+            return 1;
+        }
+        
+        // Start now if queued, backing off or a pending array element,
+        // continue if stopped
+        if (index >= 0) {
+            array_take(job_info(job)->array, index);
+            job = array_start(job, index, NULL, 0);
+            if (job == NULL) return 1;
+        } else if (job->state == QUEUED || job->state == BACKOFF) {
+            if (job->state == QUEUED) dequeue_job(job);
+            if (launch_job(job) < 0) return 1;
+        } else if (job->state == STOPPED) {
+            signal_job(job, SIGCONT);
+            job->state = RUNNING;
+        }
+        
+        // The automatic background class does not follow it to the
+        // foreground; bg puts it back
+        if (job_info(job)->auto_sched && bg_policy != SCHED_OTHER) {
+            job_sched_t normal;
+            sched_class(SCHED_OTHER, &normal);
+            if (sched_job(job, &normal) < 0) {
+                printf("fg: job [%s] keeps its background priority: %s\n", job_name(job),
+                       strerror(errno));
+            }
         }
         
-        printf("Bringing job [%d] to foreground: %s\n", job_id, job->command);
-        wait_for_fg(job->pid);
-        remove_job(job->pid);
+        // The reaper drops the job when it exits and marks it stopped on Ctrl+Z
+        printf("Bringing job [%s] to foreground: %s\n", job_name(job), job_command(job));
+        wait_for_fg(job->pid, job->pidfd);
         return 1;
     }
     
     // bg command - continue stopped job in background
     if (strcmp(args[0], "bg") == 0) {
-        if (args[1] == NULL) {
-            printf("Usage: bg <job_id>\n");
+        // bg --idle|--batch|--normal also changes its scheduling class
+        int policy = -1;
+        char **rest = args + 1;
+        if (rest[0] != NULL && strncmp(rest[0], "--", 2) == 0) {
+            policy = parse_policy(rest[0] + 2);
+            rest++;
+        }
+        if (rest[0] == NULL || (policy < 0 && rest != args + 1)) {
+            printf("Usage: bg [--idle|--batch|--normal] <job_id>\n");
             return 1;
         }
-        int job_id = atoi(args[1]);
-        job_t *job = find_job_by_id(job_id);
-        if (job == NULL) {
-            printf("Job [%d] not found\n", job_id);
+        int index;
+        job_t *job = find_job_by_name(rest[0], &index);
+        if (job == NULL || index >= 0) {
+            printf("Job [%s] not found\n", rest[0]);
             return 1;
         }
+        int job_id = job->job_id;
         
-        if (job->state == STOPPED) {
-            kill(job->pid, SIGCONT);
+        job_info_t *info = job_info(job);
+        if (info->array != NULL) {
+            array_bg(job, policy);
+            return 1;
+        }
+        if (policy >= 0 || info->auto_sched) {
+            job_sched_t sched;
+            sched_class(policy >= 0 ? policy : bg_policy, &sched);
+            if (sched_job(job, &sched) < 0) {
+                printf("bg: job [%d]: %s\n", job_id, strerror(errno));
+            }
+            if (policy >= 0) {
+                info->auto_sched = 0;
+                if (job->state == RUNNING) {
+                    printf("Job [%d] now scheduled as %s\n", job_id, rest[-1] + 2);
+                    return 1;
+                }
+            }
+        }
+        
+        if (job->state == WAITING) {
+            printf("Job [%d] is waiting for other jobs\n", job_id);
+        } else if (job->state == QUEUED || job->state == BACKOFF) {
+            // Skip the queue or the rest of the retry delay
+            if (job->state == QUEUED) dequeue_job(job);
+            if (launch_job(job) == 0) {
+                printf("Job [%d] started in background: %s\n", job_id, job_command(job));
+            }
+        } else if (job->state == STOPPED) {
+            signal_job(job, SIGCONT);
             job->state = RUNNING;
-            printf("Job [%d] continued in background: %s\n", job_id, job->command);
+            printf("Job [%d] continued in background: %s\n", job_id, job_command(job));
         } else {
             printf("Job [%d] is already running\n", job_id);
         }
@@ -337,15 +5885,279 @@ int builtin_command(char **args) {
             printf("Usage: kill <job_id>\n");
             return 1;
         }
-        int job_id = atoi(args[1]);
+        int index;
+        job_t *job = find_job_by_name(args[1], &index);
+        if (job == NULL) {
+            printf("Job [%s] not found\n", args[1]);
+            return 1;
+        }
+        int job_id = job->job_id;
+        
+        job_info_t *info = job_info(job);
+        if (index >= 0) {
+            array_take(info->array, index);
+            info->array->cancelled++;
+            printf("Job [%s] cancelled\n", args[1]);
+            array_update(job_id);
+            return 1;
+        }
+        if (info->array != NULL && job->state != WAITING) {
+            printf("Job [%d] cancelled: %d pending, %d running\n", job_id,
+                   info->array->pending, info->array->running);
+            kill_job(job);
+            return 1;
+        }
+        printf("Job [%s] %s\n", job_name(job), job->state == QUEUED || job->state == WAITING ||
+               job->state == BACKOFF ? "cancelled" : "terminated");
+        kill_job(job);
+        return 1;
+    }
+    
+    // renice command - change the priority of a queued job
+    if (strcmp(args[0], "renice") == 0) {
+        if (args[1] == NULL || args[2] == NULL) {
+            printf("Usage: renice <prio> <job_id>\n");
+            return 1;
+        }
+        int job_id = atoi(args[2]);
         job_t *job = find_job_by_id(job_id);
         if (job == NULL) {
             printf("Job [%d] not found\n", job_id);
             return 1;
         }
+        if (job->state != QUEUED && job->state != WAITING && job->state != BACKOFF) {
+            printf("Job [%d] is not queued\n", job_id);
+            return 1;
+        }
+        requeue_job(job, atoi(args[1]));
+        printf("Job [%d] priority %d\n", job_id, job_info(job)->priority);
+        return 1;
+    }
+    
+    // hash command - inspect, fill or clear the command path cache
+    if (strcmp(args[0], "hash") == 0) {
+        if (args[1] == NULL) {
+            list_cmd_cache();
+        } else if (strcmp(args[1], "-r") == 0) {
+            cmd_cache_flush(0);
+        } else {
+            for (int i = 1; args[i] != NULL; i++) {
+                if (resolve_command(args[i]) == NULL) {
+                    printf("hash: %s: not found\n", args[i]);
+                }
+            }
+        }
+        return 1;
+    }
+    
+    // set command - show or change shell settings
+    if (strcmp(args[0], "set") == 0) {
+        if (args[1] == NULL) {
+            printf("spawn    %s\n", spawn_names[spawn_backend]);
+            printf("pipesize %d%s\n", pipe_size, pipe_size ? "" : " (default)");
+            printf("relay    %s\n", pipe_relay ? "on" : "off");
+            printf("bgsched  %s\n", bg_policy == SCHED_IDLE ? "idle" :
+                   bg_policy == SCHED_BATCH ? "batch" : "normal");
+            char grace[32];
+            format_duration(kill_grace_ns, grace, sizeof(grace));
+            printf("grace    %s (%d timers armed)\n", grace, wheel_size());
+            printf("numa     %s", numa_enabled ? "on" : "off");
+            for (int i = 0; i < numa_count; i++) {
+                printf("%snode %d: %d CPUs, %d jobs", i ? ", " : " (", numa_nodes[i].id,
+                       CPU_COUNT(&numa_nodes[i].cpus), numa_nodes[i].jobs);
+            }
+            printf("%s\n", numa_count ? ")" : "");
+            printf("cgroup   %s\n", cgroup_root[0] ? cgroup_root : "(the shell's own)");
+            printf("perf     %s\n", !perf_enabled ? "off" : perf_user_only ? "on (user space only)" : "on");
+            if (capture_size > 0) {
+                printf("capture  %zu\n", capture_size);
+            } else {
+                printf("capture  off\n");
+            }
+            printf("maxjobs  %d%s (%d running, %d queued, %d waiting)\n", max_running,
+                   max_running ? "" : " (unlimited)", active_jobs, queue_len,
+                   job_count - active_jobs - queue_len);
+            if (control_fd >= 0) {
+                printf("control  %s (%d clients)\n", control_path, control_count);
+            } else {
+                printf("control  off\n");
+            }
+            return 1;
+        }
+        if (strcmp(args[1], "control") == 0 && args[2] != NULL) {
+            if (strcmp(args[2], "off") == 0) {
+                control_close();
+            } else {
+                control_open(args[2]);
+            }
+            return 1;
+        }
+        if (strcmp(args[1], "maxjobs") == 0 && args[2] != NULL && atoi(args[2]) >= 0) {
+            max_running = atoi(args[2]);
+            dispatch_queued();
+            notify_pending = 0;
+            return 1;
+        }
+        if (strcmp(args[1], "pipesize") == 0 && args[2] != NULL && parse_size(args[2]) >= 0) {
+            int size = parse_size(args[2]) ? check_pipe_size(parse_size(args[2])) : 0;
+            if (size >= 0) pipe_size = size;
+            return 1;
+        }
+        if (strcmp(args[1], "capture") == 0 && args[2] != NULL) {
+            // Ring size per job; rounded up to a power-of-two number of pages
+            long long size = strcmp(args[2], "off") == 0 ? 0 : parse_size(args[2]);
+            if (size >= 0 && size <= (1LL << 30)) {
+                capture_size = size;
+                return 1;
+            }
+        }
+        if (strcmp(args[1], "grace") == 0 && args[2] != NULL && parse_duration(args[2]) > 0) {
+            // Jobs already past their SIGTERM keep the grace they were given
+            kill_grace_ns = parse_duration(args[2]);
+            return 1;
+        }
+        if (strcmp(args[1], "bgsched") == 0 && args[2] != NULL && parse_policy(args[2]) >= 0) {
+            // Jobs already running keep what they have
+            bg_policy = parse_policy(args[2]);
+            return 1;
+        }
+        if (strcmp(args[1], "numa") == 0 && args[2] != NULL &&
+            (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0)) {
+            numa_enabled = strcmp(args[2], "on") == 0 && numa_load() == 0;
+            return 1;
+        }
+        if (strcmp(args[1], "cgroup") == 0 && args[2] != NULL) {
+            int fd = open(args[2], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0 || strlen(args[2]) >= sizeof(cgroup_root)) {
+                printf("cgroup: %s: %s\n", args[2], fd < 0 ? strerror(errno) : "path too long");
+                if (fd >= 0) close(fd);
+                return 1;
+            }
+            for (int slot = job_head; slot != NO_SLOT; slot = job_at(slot)->next) {
+                if (job_info(job_at(slot))->cgroup != NULL) {
+                    printf("cgroup: jobs still use %s; try again once they finish\n", cgroup_root);
+                    close(fd);
+                    return 1;
+                }
+            }
+            if (cgroup_root_fd >= 0) close(cgroup_root_fd);
+            cgroup_root_fd = fd;
+            strcpy(cgroup_root, args[2]);
+            return 1;
+        }
+        if (strcmp(args[1], "perf") == 0 && args[2] != NULL &&
+            (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0)) {
+            perf_enabled = 0;
+            if (strcmp(args[2], "on") == 0) {
+                // Try the shell itself first; fall back to user space only
+                // if perf_event_paranoid forbids kernel counting
+                perf_group_t probe;
+                perf_user_only = 0;
+                int rc = perf_open(0, &probe);
+                if (rc < 0 && (errno == EACCES || errno == EPERM)) {
+                    perf_user_only = 1;
+                    rc = perf_open(0, &probe);
+                }
+                if (rc < 0) {
+                    int err = errno;
+                    FILE *f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+                    int paranoid;
+                    if (f != NULL && fscanf(f, "%d", &paranoid) == 1 &&
+                        (err == EACCES || err == EPERM)) {
+                        printf("perf: not permitted (perf_event_paranoid is %d)\n", paranoid);
+                    } else {
+                        printf("perf: hardware counters unavailable: %s\n", strerror(err));
+                    }
+                    if (f != NULL) fclose(f);
+                    return 1;
+                }
+                perf_close(&probe);
+                perf_enabled = 1;
+            }
+            return 1;
+        }
+        if (strcmp(args[1], "relay") == 0 && args[2] != NULL &&
+            (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0)) {
+            pipe_relay = strcmp(args[2], "on") == 0;
+            return 1;
+        }
+        if (strcmp(args[1], "spawn") == 0 && args[2] != NULL) {
+            for (int i = 0; i <= SPAWN_ZYGOTE; i++) {
+                if (strcmp(args[2], spawn_names[i]) == 0) {
+                    if (i == SPAWN_ZYGOTE && zygote_sock < 0) {
+                        printf("set: zygote is not running\n");
+                    } else {
+                        spawn_backend = i;
+                    }
+                    return 1;
+                }
+            }
+        }
+        printf("Usage: set spawn <fork|vfork|posix_spawn|zygote>\n");
+        printf("       set maxjobs <n>   (0 = no limit)\n");
+        printf("       set pipesize <bytes>   (0 = kernel default)\n");
+        printf("       set relay <on|off>\n");
+        printf("       set perf <on|off>\n");
+        printf("       set cgroup <dir>\n");
+        printf("       set numa <on|off>\n");
+        printf("       set bgsched <normal|batch|idle>\n");
+        printf("       set grace <duration>\n");
+        printf("       set capture <bytes|off>   (ring size per job)\n");
+        printf("       set control <socket path|off>\n");
+        return 1;
+    }
+    
+    // output command - show a background job's captured output
+    if (strcmp(args[0], "output") == 0) {
+        const char *name = NULL;
+        int tail = -1, follow = 0;
+        for (int i = 1; args[i] != NULL; i++) {
+            if (strcmp(args[i], "--tail") == 0 && args[i + 1] != NULL) {
+                tail = atoi(args[++i]);
+            } else if (strcmp(args[i], "--follow") == 0) {
+                follow = 1;
+            } else if (name == NULL) {
+                name = args[i];
+            } else {
+                name = NULL;
+                break;
+            }
+        }
+        int job_id = name ? atoi(name) : 0;
+        if (job_id <= 0) {
+            printf("Usage: output <job_id> [--tail N] [--follow]\n");
+            return 1;
+        }
+        // An array element's output is only found while it is in the table
+        if (strchr(name, '.') != NULL) {
+            int index;
+            job_t *job = find_job_by_name(name, &index);
+            job_id = job != NULL && index < 0 ? job->job_id : 0;
+        }
         
-        kill(job->pid, SIGKILL);
-        printf("Job [%d] terminated\n", job_id);
+        capture_t *c = find_capture(job_id);
+        if (c == NULL) {
+            printf("Job [%s] has no captured output (see 'set capture')\n", name);
+            return 1;
+        }
+        uint64_t from = tail >= 0 ? capture_tail_start(c, tail) : 0;
+        if (follow) {
+            follow_output(job_id, from);
+        } else {
+            capture_print(c, from);
+        }
+        return 1;
+    }
+    
+    // spawnbench command - measure spawn throughput of each backend
+    if (strcmp(args[0], "spawnbench") == 0) {
+        int count = args[1] ? atoi(args[1]) : 1000;
+        int ballast_mb = (args[1] && args[2]) ? atoi(args[2]) : 0;
+        if (count <= 0 || ballast_mb < 0) {
+            printf("Usage: spawnbench [count] [ballast_mb]\n");
+            return 1;
+        }
+        spawn_bench(count, ballast_mb);
         return 1;
     }
     
@@ -353,10 +6165,47 @@ int builtin_command(char **args) {
     if (strcmp(args[0], "help") == 0) {
         printf("\nAvailable commands:\n");
         printf("  <command> &     - Run command in background\n");
-        printf("  jobs            - List all jobs\n");
-        printf("  fg <job_id>     - Bring job to foreground\n");
-        printf("  bg <job_id>     - Continue stopped job in background\n");
+        printf("  -p <prio> <command> & - Queue with a priority (lower runs first)\n");
+        printf("  after <id>[,<id>...] <command> &   - Run once those jobs finish\n");
+        printf("  afterok <id>[,<id>...] <command> & - ...only if they exit 0\n");
+        printf("  <cmd> | <cmd> ... [&] - Run a pipeline as one job\n");
+        printf("  <cmd> < in > out 2> err &> both >> append - Redirect I/O\n");
+        printf("  -o <file> [--pipe-size <n>] [--prealloc <n>] <cmd> & - Send job output to a file\n");
+        printf("  --cpu-max <cpus> --mem-max <n> --io-weight <w> [--cgroup <name>] <cmd> &\n");
+        printf("                  - Run in a cgroup with these limits (shared by name)\n");
+        printf("  --node <id> <command> & - Pin a job to a NUMA node's CPUs and memory\n");
+        printf("  --sched <normal|batch|idle> --nice <n> --ioprio <idle|be[:0-7]> <command>\n");
+        printf("                  - CPU policy, nice value and I/O class of the job\n");
+        printf("  --timeout <30s|5m|2h> --deadline <HH:MM> <command> &\n");
+        printf("                  - SIGTERM the job when either passes, SIGKILL after a grace period\n");
+        printf("  --retry <n> [--backoff <base>[,<max>]] [--retry-on <status>,...] <command> &\n");
+        printf("                  - Run a failed job again, up to n times, after growing delays\n");
+        printf("  array <first>-<last>[%%<limit>] <command with {}> & - Run once per index\n");
+        printf("  parallel [-j <jobs>] [-n <items>] <command> [{}] < <file>\n");
+        printf("                  - Run the command on each line (or -n lines) of the file, like xargs -P\n");
+        printf("  jobs [-l]       - List all jobs (-l: with resource usage)\n");
+        printf("  history [n]     - Last n completed jobs with resource usage\n");
+        printf("  stats           - Totals and percentiles over completed jobs\n");
+        printf("  latency [reset] - Launch, run and reap latency percentiles\n");
+        printf("  fg <job_id>     - Bring job (or array element <id>.<index>) to foreground\n");
+        printf("  bg [--idle|--batch|--normal] <job_id> - Continue in background / reschedule\n");
         printf("  kill <job_id>   - Terminate a job\n");
+        printf("  renice <prio> <job_id> - Change priority of a queued job\n");
+        printf("  hash [-r | name...]   - Show, clear or add cached command paths\n");
+        printf("  set [spawn <backend>] - Show settings / pick fork, vfork, posix_spawn or zygote\n");
+        printf("  set maxjobs <n>       - Run at most n background jobs, queue the rest\n");
+        printf("  set pipesize <bytes>  - Buffer size of each pipeline link\n");
+        printf("  set relay <on|off>    - Splice pipeline data through the shell\n");
+        printf("  set perf <on|off>     - Count cycles, instructions and misses per job\n");
+        printf("  set cgroup <dir>      - Delegated cgroup v2 subtree for job cgroups\n");
+        printf("  set numa <on|off>     - Place background jobs on the least busy NUMA node\n");
+        printf("  set bgsched <normal|batch|idle> - Default class for background jobs\n");
+        printf("  set grace <duration>  - Time between a timed-out job's SIGTERM and SIGKILL\n");
+        printf("  set capture <n|off>   - Capture background job output in n-byte rings\n");
+        printf("  set control <path|off> - Accept JSON requests (submit, list, kill, wait, stats)\n");
+        printf("                          on a Unix socket\n");
+        printf("  output <job_id> [--tail N] [--follow] - Show captured output\n");
+        printf("  spawnbench [n] [mb]   - Compare spawn backends (optional MB of ballast)\n");
         printf("  quit/exit       - Exit shell\n");
         printf("  Ctrl+C          - Interrupt foreground job\n");
         printf("  Ctrl+Z          - Suspend foreground job\n\n");
@@ -366,55 +6215,315 @@ int builtin_command(char **args) {
     return 0;  // Not a builtin command
 }
 
-// Signal handlers
-void sigchld_handler(int sig) {
-    int status;
-    pid_t pid;
+// Spawn 'true' count times per backend and report spawns/sec. The
+// ballast stands in for a shell with a large heap, which is what makes
+// fork's page table copy expensive.
+void spawn_bench(int count, int ballast_mb) {
+    char *argv[] = { "true", NULL };
+    size_t ballast_size = (size_t)ballast_mb << 20;
+    char *ballast = NULL;
+    spawn_backend_t saved = spawn_backend;
     
-    // Reap all terminated/stopped children
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-        job_t *job = find_job_by_pid(pid);
-        
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            // Process terminated
-            if (job) {
-                printf("\n[%d] Done: %s\n", job->job_id, job->command);
-                printf("shell> ");
-                fflush(stdout);
-                remove_job(pid);
-            }
-        } else if (WIFSTOPPED(status)) {
-            // Process stopped
-            if (job) {
-                update_job_state(pid, STOPPED);
-                printf("\n[%d] Stopped: %s\n", job->job_id, job->command);
-                printf("shell> ");
-                fflush(stdout);
-            } else {
-                // Foreground job stopped - add to job list
-                char cmd[MAX_LINE];
-                snprintf(cmd, MAX_LINE, "(foreground job)");
-                add_job(pid, cmd, STOPPED);
-                printf("\n[%d] Stopped (use 'fg %d' to resume)\n", 
-                       jobs[job_count-1].job_id, jobs[job_count-1].job_id);
-                printf("shell> ");
-                fflush(stdout);
+    if (ballast_size > 0) {
+        ballast = malloc(ballast_size);
+        if (ballast == NULL) {
+            printf("spawnbench: cannot allocate %d MB\n", ballast_mb);
+            return;
+        }
+        memset(ballast, 1, ballast_size);
+    }
+    
+    printf("Spawning 'true' %d times per backend (%d MB ballast)\n", count, ballast_mb);
+    fflush(stdout);
+    for (int b = 0; b <= SPAWN_ZYGOTE; b++) {
+        int failed = 0;
+        if (b == SPAWN_ZYGOTE && zygote_sock < 0) continue;
+        spawn_backend = b;
+        
+        // Children are waited for directly: they have no pidfd, and the
+        // SIGCHLD path only collects stops
+        int64_t start = now_ns();
+        for (int i = 0; i < count; i++) {
+            spawn_req_t req = { .argv = argv, .fds = { -1, -1, -1 } };
+            req.path = resolve_command(argv[0]);
+            pid_t pid = spawn_child(&req);
+            if (pid < 0) {
+                failed++;
+                continue;
             }
+            waitpid(pid, NULL, 0);
         }
+        double secs = (now_ns() - start) / 1e9;
+        
+        printf("  %-12s %9.0f spawns/sec  %8.1f us/spawn", spawn_names[b],
+               count / secs, secs * 1e6 / count);
+        if (failed) printf("  (%d failed)", failed);
+        printf("\n");
     }
+    
+    spawn_backend = zygote_sock < 0 && saved == SPAWN_ZYGOTE ? SPAWN_POSIX : saved;
+    free(ballast);
 }
 
-void sigint_handler(int sig) {
-    // Only forward to foreground process
-    if (fg_pid > 0) {
-        kill(fg_pid, SIGINT);
+// Forward a signal to the foreground job, all of it for a pipeline
+static void signal_fg(int sig) {
+    job_t *job = find_job_by_pid(fg_pid);
+    if (job != NULL) {
+        signal_job(job, sig);
+    } else {
+        pidfd_send_signal(fg_pidfd, sig, NULL, 0);
     }
-    printf("\n");
 }
 
-void sigtstp_handler(int sig) {
-    // Only forward to foreground process
-    if (fg_pid > 0) {
-        kill(fg_pid, SIGTSTP);
+// Drain the signalfd. Exits are reported per job through pidfds, so
+// SIGCHLD only matters for stops; any number of them costs one pass.
+void handle_signals() {
+    struct signalfd_siginfo info[16];
+    int child_changed = 0;
+    ssize_t n;
+    
+    while ((n = read(signal_fd, info, sizeof(info))) > 0) {
+        for (size_t i = 0; i < n / sizeof(info[0]); i++) {
+            switch (info[i].ssi_signo) {
+                case SIGCHLD:
+                    child_changed = 1;
+                    break;
+                case SIGINT:
+                    // Only forward to foreground process
+                    if (fg_pid > 0) {
+                        signal_fg(SIGINT);
+                    } else if (fg_array > 0 && find_job_by_id(fg_array) != NULL) {
+                        array_cancel(find_job_by_id(fg_array), SIGINT);
+                    }
+                    following = 0;
+                    printf("\n");
+                    if (at_prompt) print_prompt();
+                    break;
+                case SIGTSTP:
+                    // Only forward to foreground process
+                    if (fg_pid > 0) {
+                        signal_fg(SIGTSTP);
+                    } else if (fg_array > 0) {
+                        printf("\n[%d] Continuing in background\n", fg_array);
+                        fg_array = 0;
+                    }
+                    break;
+            }
+        }
+    }
+    
+    if (child_changed) {
+        reap_stopped();
+    }
+}
+
+// Register a child's pidfd with the event loop; it becomes readable
+// once the child exits
+int watch_child(uint64_t tag, int pidfd) {
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u64 = tag;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &ev);
+}
+
+// Kill and reap a child the job table could not take
+void discard_child(int pidfd) {
+    siginfo_t info;
+    pidfd_send_signal(pidfd, SIGKILL, NULL, 0);
+    waitid(P_PIDFD, pidfd, &info, WEXITED);
+    close(pidfd);
+}
+
+// waitid() that also fills in the child's rusage: the system call has a
+// fifth argument the libc wrapper leaves out
+static int waitid_rusage(int pidfd, siginfo_t *info, int options, struct rusage *ru) {
+    memset(ru, 0, sizeof(*ru));
+    return syscall(SYS_waitid, P_PIDFD, pidfd, info, options, ru);
+}
+
+// Exit code, or 128 + signal like the shell's $?; -1 if unknown
+static int exit_status(const siginfo_t *info) {
+    if (info->si_pid == 0) return -1;
+    return info->si_code == CLD_EXITED ? info->si_status : 128 + info->si_status;
+}
+
+static void rusage_to_usage(const struct rusage *ru, job_usage_t *u) {
+    memset(u, 0, sizeof(*u));
+    u->user_us = (int64_t)ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec;
+    u->sys_us = (int64_t)ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+    u->maxrss_kb = ru->ru_maxrss;
+    u->minflt = ru->ru_minflt;
+    u->majflt = ru->ru_majflt;
+    u->nvcsw = ru->ru_nvcsw;
+    u->nivcsw = ru->ru_nivcsw;
+}
+
+// A child's pidfd became readable: collect its exit status and usage
+void reap_job(pid_t pid) {
+    job_t *job = find_job_by_pid(pid);
+    int foreground = (pid == fg_pid);
+    int pidfd = job ? job->pidfd : (foreground ? fg_pidfd : -1);
+    siginfo_t info;
+    struct rusage ru;
+    job_usage_t usage;
+    
+    if (pidfd < 0) return;
+    
+    // Spurious wakeup if it has not exited yet; an error means the child
+    // is gone anyway
+    info.si_pid = 0;
+    if (waitid_rusage(pidfd, &info, WEXITED | WNOHANG, &ru) == 0 && info.si_pid == 0) {
+        return;
+    }
+    rusage_to_usage(&ru, &usage);
+    perf_collect(job ? &job_info(job)->perf : &fg_perf, &usage);
+    latency_record(&reap_latency, now_ns() - wake_ns);
+    if (job || foreground) {
+        latency_record(&run_latency, wake_ns - (job ? job->started_ns : fg_started_ns));
+    }
+    
+    // Closing the pidfd also drops it from the epoll set
+    close(pidfd);
+    if (foreground) {
+        fg_pid = 0;
+        fg_pidfd = -1;
+        if (fg_command != UINT32_MAX) {
+            if (job == NULL) {
+                history_add(0, fg_command, exit_status(&info), fg_started_ns, &usage);
+            }
+            str_release(fg_command);
+            fg_command = UINT32_MAX;
+        }
+    }
+    if (job) {
+        job_info(job)->status = exit_status(&info);
+        usage_add(&job_info(job)->usage, &usage);
+        finish_job(job, foreground);
+        
+        // A run slot opened up
+        dispatch_queued();
+    }
+}
+
+// A pipeline stage's pidfd became readable. The job is done once its
+// last stage has been reaped.
+void reap_stage(int job_id, int stage) {
+    job_t *job = find_job_by_id(job_id);
+    pipeline_t *pl = job ? job_info(job)->pipeline : NULL;
+    if (pl == NULL || stage >= pl->nstages || pl->stages[stage].pidfd < 0) {
+        return;  // Stale event
+    }
+    
+    // Leave stage 0 a zombie while others run: its pid is the job's key
+    // and the group id, and must not be reused until the job is gone
+    stage_t *st = &pl->stages[stage];
+    int keep = (stage == 0 && pl->live > 1);
+    siginfo_t info;
+    struct rusage ru;
+    info.si_pid = 0;
+    if (waitid_rusage(st->pidfd, &info, WEXITED | WNOHANG | (keep ? WNOWAIT : 0), &ru) == 0 &&
+        info.si_pid == 0) {
+        return;
+    }
+    if (keep) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, st->pidfd, NULL);
+        return;
+    }
+    
+    close(st->pidfd);
+    st->pidfd = -1;
+    latency_record(&reap_latency, now_ns() - wake_ns);
+    job_usage_t usage;
+    rusage_to_usage(&ru, &usage);
+    perf_collect(&st->perf, &usage);
+    usage_add(&job_info(job)->usage, &usage);
+    if (stage == pl->nstages - 1) {
+        job_info(job)->status = exit_status(&info);
+    }
+    if (--pl->live == 1 && pl->stages[0].pidfd >= 0) {
+        // Only the leader is left; watch it again (a no-op if it never
+        // exited) and reap it when it reports
+        watch_child(EV_STAGE | EV_JOB(job_id, 0), pl->stages[0].pidfd);
+        return;
+    }
+    if (pl->live > 0) return;
+    
+    latency_record(&run_latency, wake_ns - job->started_ns);
+    int foreground = job->pid == fg_pid;
+    if (foreground) {
+        fg_pid = 0;
+        fg_pidfd = -1;
+    }
+    finish_job(job, foreground);
+    
+    // A run slot opened up
+    dispatch_queued();
+}
+
+// Find the job a process belongs to: by pid for single processes and
+// pipeline leaders, else as a stage of a background pipeline (through its
+// process group) or of the foreground one
+static job_t* find_job_by_process(pid_t pid) {
+    job_t *job = find_job_by_pid(pid);
+    if (job != NULL) return job;
+    
+    pid_t pgid = getpgid(pid);
+    job_t *candidates[2] = { pgid > 0 ? find_job_by_pid(pgid) : NULL,
+                             fg_pid > 0 ? find_job_by_pid(fg_pid) : NULL };
+    for (int c = 0; c < 2; c++) {
+        pipeline_t *pl = candidates[c] ? job_info(candidates[c])->pipeline : NULL;
+        for (int i = 0; pl != NULL && i < pl->nstages; i++) {
+            if (pl->stages[i].pid == pid) return candidates[c];
+        }
+    }
+    return NULL;
+}
+
+// Collect stop reports. WSTOPPED without WEXITED never consumes an exit
+// status, so this cannot race with reap_job().
+void reap_stopped() {
+    siginfo_t info;
+    
+    for (;;) {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WSTOPPED | WNOHANG) < 0 || info.si_pid == 0) {
+            break;
+        }
+        
+        pid_t pid = info.si_pid;
+        job_t *job = find_job_by_process(pid);
+        if (fg_pid > 0 && (pid == fg_pid || (job != NULL && job->pid == fg_pid))) {
+            fg_pid = 0;
+            if (job == NULL) {
+                // Foreground job stopped - add to job list, handing over its pidfd
+                job = add_job(0, pid, fg_pidfd, "(foreground job)", STOPPED);
+                if (fg_command != UINT32_MAX) {
+                    str_release(fg_command);
+                    fg_command = UINT32_MAX;
+                }
+                if (job) {
+                    job->started_ns = fg_started_ns;
+                    job_info(job)->perf = fg_perf;
+                    printf("\n[%d] Stopped (use 'fg %d' to resume)\n", 
+                           job->job_id, job->job_id);
+                } else {
+                    discard_child(fg_pidfd);
+                    perf_close(&fg_perf);
+                }
+                fg_pidfd = -1;
+                for (int i = 0; i < PERF_COUNTERS; i++) {
+                    fg_perf.fd[i] = -1;
+                }
+                notify_pending = 1;
+                continue;
+            }
+            fg_pidfd = -1;
+        }
+        
+        // One notice per job, however many pipeline stages report
+        if (job && job->state != STOPPED) {
+            job->state = STOPPED;
+            printf("\n[%s] Stopped: %s\n", job_name(job), job_command(job));
+            notify_pending = 1;
+        }
     }
-}
\ No newline at end of file
+}